@@ -0,0 +1,583 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bitmap.h"
+#include "bitmap_pool.h"
+#include "console.h"
+#include "readout.h"
+#include "font_format.h"
+#include "framebuffer.h"
+#include "text.h"
+#include "text_cache.h"
+#include "unicode.h"
+#include "worker_pool.h"
+
+#define BENCH_MIN_SECONDS 0.2
+
+
+typedef struct bench_t {
+    const char *name;
+    void (*fn)(const struct bench_t *bench, long iterations);
+    const char *unit;
+    double units;
+    int arg;
+    int arg2;
+    const void *font;
+} bench_t;
+
+extern unsigned char bench_font_bin[];
+extern const font_table_t bench_font_table;
+extern unsigned char bench_mono_bin[];
+
+static bitmap_t *dst;
+static bitmap_t *src;
+static bitmap_t *page;
+static char page_text[24 * 160];
+static char *doc_text;
+static size_t doc_size;
+static worker_pool_t *pools[8];
+static volatile size_t sink;
+
+static const char *bench_text = "The quick brown fox jumps over the lazy "
+        "dog. Pack my box with five dozen liquor jugs \xe2\x80\x94 "
+        "caf\xc3\xa9, na\xc3\xafve, \xc2\xbd \xc3\xa0 la carte.";
+static const char *bench_ascii = "The quick brown fox jumps over the lazy "
+        "dog. Pack my box with five dozen liquor jugs - cafe, naive, 1/2 a la "
+        "carte.";
+
+static double bench_now(void);
+static void bench_run(const bench_t *bench);
+static void bench_lookup(const bench_t *bench, long iterations);
+static void bench_lookup_table(const bench_t *bench, long iterations);
+static void bench_utf8_len(const bench_t *bench, long iterations);
+static void bench_utf8_decode(const bench_t *bench, long iterations);
+static void bench_blit(const bench_t *bench, long iterations);
+static void bench_blit_orient(const bench_t *bench, long iterations);
+static void bench_fill(const bench_t *bench, long iterations);
+static void bench_alloc_heap(const bench_t *bench, long iterations);
+static void bench_alloc_pool(const bench_t *bench, long iterations);
+static void bench_render(const bench_t *bench, long iterations);
+static void bench_render_rotated(const bench_t *bench, long iterations);
+static void bench_render_cached(const bench_t *bench, long iterations);
+static void bench_render_clipped(const bench_t *bench, long iterations);
+static void bench_render_parallel(const bench_t *bench, long iterations);
+static void bench_framebuffer_diff(const bench_t *bench, long iterations);
+static void bench_view(const bench_t *bench, long iterations);
+static void bench_console(const bench_t *bench, long iterations);
+static void bench_readout(const bench_t *bench, long iterations);
+static size_t bench_doc_read(void *arg, uint32_t offset, void *buf,
+        size_t size);
+
+
+int main(int argc, char *argv[])
+{
+    static const char *overflows[] = {
+        "break_word", "word", "wrap", "wrap_word",
+    };
+    static const char *aligns[] = {
+        "left", "center", "right", "justify",
+    };
+    const char *filter = argc > 1 ? argv[1] : NULL;
+
+    dst = bitmap_new(296, 128);
+    src = bitmap_new(128, 64);
+    for (int i = 0; i < 16 * 64; i++) {
+        src->data[i] = i * 37;
+    }
+    page = bitmap_new(800, 480);
+    for (int i = 0; i < 24; i++) {
+        strcat(page_text, bench_text);
+        strcat(page_text, " ");
+    }
+    /* about 1 MiB of text in two sentence paragraphs */
+    size_t text_size = strlen(bench_text);
+    doc_text = malloc(1024 * 1024);
+    assert(doc_text != NULL);
+    while (doc_size + 2 * text_size + 2 <= 1024 * 1024) {
+        char *p = doc_text + doc_size;
+        memcpy(p, bench_text, text_size);
+        p[text_size] = ' ';
+        memcpy(p + text_size + 1, bench_text, text_size);
+        p[2 * text_size + 1] = '\n';
+        doc_size += 2 * text_size + 2;
+    }
+
+    bench_t benches[23 + 16 + 19] = {
+        { "lookup/latin", bench_lookup, "glyphs", 95, 0x20 },
+        { "lookup/group", bench_lookup, "glyphs", 24, 0x2010 },
+        { "lookup/table/ascii", bench_lookup_table, "glyphs", 95, 0x20 },
+        { "lookup/table/range", bench_lookup_table, "glyphs", 24, 0x2010 },
+        { "utf8_len", bench_utf8_len, "bytes", strlen(bench_text) },
+        { "utf8_len/ascii", bench_utf8_len, "bytes", strlen(bench_ascii), 1 },
+        { "utf8_decode", bench_utf8_decode, "bytes", strlen(bench_text) },
+        { "utf8_decode/ascii", bench_utf8_decode, "bytes",
+                strlen(bench_ascii), 1 },
+        { "blit2/aligned/16x16", bench_blit, "pixels", 16 * 16, 16, 16 },
+        { "blit2/unaligned/16x16", bench_blit, "pixels", 16 * 16, 16, 19 },
+        { "blit2/aligned/128x64", bench_blit, "pixels", 128 * 64, 128, 8 },
+        { "blit2/unaligned/128x64", bench_blit, "pixels", 128 * 64, 128, 11 },
+        { "blit_orient/rotate_90/128x64", bench_blit_orient, "pixels",
+                128 * 64, BITMAP_ORIENT_ROTATE_90, 11 },
+        { "blit_orient/rotate_180/128x64", bench_blit_orient, "pixels",
+                128 * 64, BITMAP_ORIENT_ROTATE_180, 11 },
+        { "blit_orient/rotate_270/128x64", bench_blit_orient, "pixels",
+                128 * 64, BITMAP_ORIENT_ROTATE_270, 11 },
+        { "blit_orient/flip_x/128x64", bench_blit_orient, "pixels", 128 * 64,
+                BITMAP_ORIENT_FLIP_X, 11 },
+        { "fill_rect/unaligned/128x64", bench_fill, "pixels", 128 * 64, 128,
+                11 },
+        { "hline/unaligned/128", bench_fill, "pixels", 128, 128, 11 },
+        { "alloc/heap/24x16", bench_alloc_heap, "bitmaps", 1, 24, 16 },
+        { "alloc/pool/24x16", bench_alloc_pool, "bitmaps", 1, 24, 16 },
+        { "framebuffer_diff/clean", bench_framebuffer_diff, "bytes",
+                296 * 128 / 8, 0 },
+        { "framebuffer_diff/label", bench_framebuffer_diff, "bytes",
+                296 * 128 / 8, 16 },
+        { "framebuffer_diff/full", bench_framebuffer_diff, "bytes",
+                296 * 128 / 8, 128 },
+    };
+    int count = 23;
+    static char names[16][48];
+    for (int overflow = 0; overflow < 4; overflow++) {
+        for (int align = 0; align < 4; align++) {
+            char *name = names[overflow * 4 + align];
+            snprintf(name, sizeof(names[0]), "render/%s/%s",
+                    overflows[overflow], aligns[align]);
+            benches[count++] = (bench_t) { name, bench_render, "pixels",
+                    dst->width * dst->height, overflow, align };
+        }
+    }
+
+    benches[count++] = (bench_t) { "render_table/wrap_word/left",
+            bench_render, "pixels", dst->width * dst->height, 3, 0,
+            &bench_font_table };
+    benches[count++] = (bench_t) { "render_mono/wrap_word/left",
+            bench_render, "pixels", dst->width * dst->height, 3, 0,
+            bench_mono_bin };
+    benches[count++] = (bench_t) { "render_rotated/rotate_90",
+            bench_render_rotated, "pixels", dst->width * dst->height,
+            BITMAP_ORIENT_ROTATE_90 };
+    benches[count++] = (bench_t) { "render_rotated/rotate_180",
+            bench_render_rotated, "pixels", dst->width * dst->height,
+            BITMAP_ORIENT_ROTATE_180 };
+    benches[count++] = (bench_t) { "render_cached/label", bench_render_cached,
+            "pixels", 128 * 24, 128, 24 };
+    benches[count++] = (bench_t) { "render_cached/page", bench_render_cached,
+            "pixels", dst->width * dst->height, dst->width, dst->height };
+    benches[count++] = (bench_t) { "render_clipped/none",
+            bench_render_clipped, "pixels", 64 * 128, 0 };
+    benches[count++] = (bench_t) { "render_clipped/16", bench_render_clipped,
+            "pixels", 64 * 16, 16 };
+    static char parallel_names[4][32];
+    for (int i = 0; i < 4; i++) {
+        int workers = 1 << i;
+        snprintf(parallel_names[i], sizeof(parallel_names[0]),
+                "render_parallel/%d", workers);
+        benches[count++] = (bench_t) { parallel_names[i],
+                bench_render_parallel, "pixels", page->width * page->height,
+                workers };
+    }
+    benches[count++] = (bench_t) { "view/index", bench_view, "bytes",
+            doc_size, 0 };
+    benches[count++] = (bench_t) { "view/render", bench_view, "pixels",
+            dst->width * dst->height, 1 };
+    benches[count++] = (bench_t) { "view/scroll", bench_view, "pixels",
+            dst->width * dst->height, 2 };
+    benches[count++] = (bench_t) { "console/line", bench_console, "lines", 1,
+            0 };
+    benches[count++] = (bench_t) { "console/redraw", bench_console, "lines",
+            1, 1 };
+    benches[count++] = (bench_t) { "readout/clock", bench_readout, "updates",
+            1, 0 };
+    benches[count++] = (bench_t) { "readout/redraw", bench_readout,
+            "updates", 1, 1 };
+
+    printf("%-28s %12s %12s %16s\n", "benchmark", "iterations", "ns/op",
+            "throughput");
+    for (int i = 0; i < count; i++) {
+        if (filter == NULL || strstr(benches[i].name, filter)) {
+            bench_run(&benches[i]);
+        }
+    }
+
+    for (int i = 0; i < 8; i++) {
+        worker_pool_free(pools[i]);
+    }
+    free(doc_text);
+    bitmap_free(page);
+    bitmap_free(src);
+    bitmap_free(dst);
+    return 0;
+}
+
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/* Doubles the iteration count until a run takes at least BENCH_MIN_SECONDS,
+ * so every workload is timed over a comparable span.
+ */
+static void bench_run(const bench_t *bench)
+{
+    long iterations = 1;
+    double elapsed;
+
+    bench->fn(bench, 1);
+    while (true) {
+        double start = bench_now();
+        bench->fn(bench, iterations);
+        elapsed = bench_now() - start;
+        if (elapsed >= BENCH_MIN_SECONDS) {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    double ns = elapsed * 1e9 / iterations;
+    double rate = bench->units * iterations / elapsed;
+    printf("%-28s %12ld %12.1f %9.2f M%s/s\n", bench->name, iterations, ns,
+            rate / 1e6, bench->unit);
+}
+
+
+/* Resolves a run of code points to glyph records the way text_render does,
+ * through the latin table or the group search.
+ */
+static void bench_lookup(const bench_t *bench, long iterations)
+{
+    const uint8_t *font = bench_font_bin;
+    size_t sum = 0;
+
+    for (long i = 0; i < iterations; i++) {
+        for (uint32_t cp = bench->arg; cp < bench->arg + bench->units; cp++) {
+            const font_group_t *group = font_find_group(font, cp);
+            if (group) {
+                const uint32_t *offsets = (const uint32_t *)(font +
+                        group->offsets);
+                sum += offsets[cp - group->first] & ~FONT_OFFSET_RLE;
+            }
+        }
+    }
+    sink = sum;
+}
+
+
+/* The same lookups through a font table compiled to C.
+ */
+static void bench_lookup_table(const bench_t *bench, long iterations)
+{
+    size_t sum = 0;
+
+    for (long i = 0; i < iterations; i++) {
+        for (uint32_t cp = bench->arg; cp < bench->arg + bench->units; cp++) {
+            const font_table_glyph_t *glyph = font_table_glyph(
+                    &bench_font_table, cp);
+            if (glyph) {
+                sum += (size_t)glyph->data;
+            }
+        }
+    }
+    sink = sum;
+}
+
+
+static void bench_utf8_len(const bench_t *bench, long iterations)
+{
+    const char *s = bench->arg ? bench_ascii : bench_text;
+    size_t sum = 0;
+
+    for (long i = 0; i < iterations; i++) {
+        sum += utf8_len(s);
+    }
+    sink = sum;
+}
+
+
+static void bench_utf8_decode(const bench_t *bench, long iterations)
+{
+    const char *s = bench->arg ? bench_ascii : bench_text;
+    uint32_t cps[128];
+    size_t sum = 0;
+
+    for (long i = 0; i < iterations; i++) {
+        sum += utf8_decode(s, bench->units, cps, 128, NULL);
+    }
+    sink = sum + cps[0];
+}
+
+
+static void bench_blit(const bench_t *bench, long iterations)
+{
+    for (long i = 0; i < iterations; i++) {
+        bitmap_blit2(dst, src, bitmap_set_pixel, bench->arg2, 8, 0, 0,
+                bench->arg, bench->units / bench->arg);
+    }
+}
+
+
+/* Blits src turned by bench->arg, which is as tall as dst once turned a
+ * quarter.
+ */
+static void bench_blit_orient(const bench_t *bench, long iterations)
+{
+    for (long i = 0; i < iterations; i++) {
+        bitmap_blit_orient(dst, src, bitmap_set_pixel, bench->arg,
+                bench->arg2, 0, 0, 0, 0, 0);
+    }
+}
+
+
+static void bench_fill(const bench_t *bench, long iterations)
+{
+    for (long i = 0; i < iterations; i++) {
+        bitmap_fill_rect(dst, bitmap_xor_pixel, bench->arg2, 8, bench->arg,
+                bench->units / bench->arg);
+    }
+}
+
+
+static void bench_alloc_heap(const bench_t *bench, long iterations)
+{
+    for (long i = 0; i < iterations; i++) {
+        bitmap_free(bitmap_new_format(bench->arg, bench->arg2,
+                BITMAP_FORMAT_HMSB));
+    }
+}
+
+
+static void bench_alloc_pool(const bench_t *bench, long iterations)
+{
+    bitmap_pool_class_t classes[] = { { 64, 4 }, { 256, 4 } };
+    bitmap_pool_t *pool = bitmap_pool_new(classes, 2);
+
+    for (long i = 0; i < iterations; i++) {
+        bitmap_pool_put(pool, bitmap_pool_get(pool, bench->arg, bench->arg2,
+                BITMAP_FORMAT_HMSB));
+    }
+    bitmap_pool_free(pool);
+}
+
+
+/* Diffs a 296x128 frame in which the top bench->arg rows of a 96 pixel wide
+ * label have been inverted.
+ */
+static void bench_framebuffer_diff(const bench_t *bench, long iterations)
+{
+    framebuffer_t *fb = framebuffer_new(296, 128, BITMAP_FORMAT_HMSB);
+    text_config_t config = { .draw_fn = bitmap_set_pixel };
+    text_render(fb->back, &config, bench_font_bin, 0, 0, 296, 128,
+            bench_text);
+    memcpy(fb->front->data, fb->back->data, bench->units);
+    if (bench->arg) {
+        bitmap_invert_rect(fb->back, 100, 0, 96, bench->arg);
+    }
+
+    size_t sum = 0;
+    for (long i = 0; i < iterations; i++) {
+        size_t count;
+        framebuffer_diff(fb, 4, &count);
+        sum += count;
+    }
+    sink = sum;
+    framebuffer_free(fb);
+}
+
+
+static void bench_render(const bench_t *bench, long iterations)
+{
+    text_config_t config = {
+        .draw_fn = bitmap_set_pixel,
+        .overflow = bench->arg,
+        .align = bench->arg2,
+        .elide_text = "\xe2\x80\xa6",
+    };
+    const void *font = bench->font ? bench->font : bench_font_bin;
+
+    for (long i = 0; i < iterations; i++) {
+        text_render(dst, &config, font, 0, 0, dst->width, dst->height,
+                bench_text);
+    }
+}
+
+
+/* Same as render/wrap_word/left, on a panel mounted turned by bench->arg.
+ */
+static void bench_render_rotated(const bench_t *bench, long iterations)
+{
+    text_config_t config = {
+        .draw_fn = bitmap_set_pixel,
+        .overflow = TEXT_OVERFLOW_WRAP_WORD,
+        .elide_text = "\xe2\x80\xa6",
+        .orient = bench->arg,
+    };
+    bool turned = bench->arg == BITMAP_ORIENT_ROTATE_90 ||
+            bench->arg == BITMAP_ORIENT_ROTATE_270;
+    int width = turned ? dst->height : dst->width;
+    int height = turned ? dst->width : dst->height;
+
+    for (long i = 0; i < iterations; i++) {
+        text_render(dst, &config, bench_font_bin, 0, 0, width, height,
+                bench_text);
+    }
+}
+
+
+/* Redraws the same text each iteration, so after the first call every
+ * render is a sprite blit.
+ */
+static void bench_render_cached(const bench_t *bench, long iterations)
+{
+    text_config_t config = {
+        .draw_fn = bitmap_set_pixel,
+        .overflow = TEXT_OVERFLOW_WRAP_WORD,
+        .elide_text = "\xe2\x80\xa6",
+    };
+    text_cache_t *cache = text_cache_new(16 * 1024);
+
+    for (long i = 0; i < iterations; i++) {
+        text_cache_render(cache, dst, &config, bench_font_bin, 0, 0,
+                bench->arg, bench->arg2, bench_text);
+    }
+    text_cache_free(cache);
+}
+
+
+/* Wraps the text into a narrow column taller than dst, as when scrolling,
+ * and draws it through a window of bench->arg rows (all of dst if 0).
+ */
+static void bench_render_clipped(const bench_t *bench, long iterations)
+{
+    text_config_t config = {
+        .draw_fn = bitmap_set_pixel,
+        .overflow = TEXT_OVERFLOW_WRAP_WORD,
+        .clip = { 0, 56, 64, bench->arg },
+    };
+
+    for (long i = 0; i < iterations; i++) {
+        text_render(dst, &config, bench_font_bin, 0, -40, 64, 512,
+                bench_text);
+    }
+}
+
+
+/* Draws a full 800x480 page of text split over bench->arg threads. The pool
+ * and layout are set up outside the loop, as an application would keep them.
+ */
+static void bench_render_parallel(const bench_t *bench, long iterations)
+{
+    text_config_t config = {
+        .draw_fn = bitmap_set_pixel,
+        .overflow = TEXT_OVERFLOW_WRAP_WORD,
+        .align = TEXT_ALIGN_JUSTIFY,
+    };
+    worker_pool_t **pool = &pools[bench->arg - 1];
+    if (*pool == NULL) {
+        *pool = worker_pool_new(bench->arg);
+    }
+    text_layout_t *layout = text_layout(&config, bench_font_bin, page->width,
+            page->height, page_text);
+
+    for (long i = 0; i < iterations; i++) {
+        text_draw_layout_parallel(*pool, page, layout, 0, 0);
+    }
+    text_layout_free(layout);
+}
+
+
+/* Indexes the whole document from a fresh view (bench->arg 0), redraws the
+ * first screen (1), or pages through the document a screen at a time (2).
+ */
+static void bench_view(const bench_t *bench, long iterations)
+{
+    text_config_t config = {
+        .draw_fn = bitmap_set_pixel,
+        .overflow = TEXT_OVERFLOW_WRAP_WORD,
+    };
+    text_view_t *view = text_view_new(&config, bench_font_bin, dst->width,
+            dst->height, bench_doc_read, NULL);
+
+    for (long i = 0; i < iterations; i++) {
+        if (bench->arg == 0) {
+            if (i > 0) {
+                text_view_invalidate(view, 0);
+            }
+            text_view_scroll_to(view, UINT32_MAX);
+            sink = text_view_top(view);
+        } else {
+            if (bench->arg == 2) {
+                uint32_t top = text_view_top(view);
+                text_view_scroll(view, text_view_rows(view));
+                if (text_view_top(view) == top) {
+                    text_view_scroll_to(view, 0);
+                }
+            }
+            text_view_render(view, dst, 0, 0);
+        }
+    }
+    text_view_free(view);
+}
+
+
+/* Prints a line to a console covering dst and flushes it each iteration.
+ * With bench->arg set every cell is redrawn, as without dirty tracking.
+ */
+static void bench_console(const bench_t *bench, long iterations)
+{
+    console_t *console = console_new(dst, bench_mono_bin, 0, 0, dst->width,
+            dst->height);
+    console_flush(console);
+
+    for (long i = 0; i < iterations; i++) {
+        console_write(console, "\nI (1234) wifi: connected, rssi -61");
+        if (bench->arg) {
+            console_invalidate(console);
+        }
+        console_flush(console);
+    }
+    console_free(console);
+}
+
+
+/* Ticks a clock readout by a second each iteration, so usually only the
+ * last digit changes. With bench->arg set the whole readout is redrawn, as
+ * without tracking the glyphs shown.
+ */
+static void bench_readout(const bench_t *bench, long iterations)
+{
+    readout_t *readout = readout_new(dst, bench_font_bin, 0, 0, 128, 24,
+            TEXT_ALIGN_RIGHT, true);
+
+    for (long i = 0; i < iterations; i++) {
+        char s[16];
+        long t = 12 * 3600 + 34 * 60 + i;
+        snprintf(s, sizeof(s), "%02ld:%02ld:%02ld", t / 3600 % 24,
+                t / 60 % 60, t % 60);
+        if (bench->arg) {
+            readout_invalidate(readout);
+        }
+        readout_set(readout, s);
+    }
+    readout_free(readout);
+}
+
+
+static size_t bench_doc_read(void *arg, uint32_t offset, void *buf,
+        size_t size)
+{
+    (void)arg;
+    if (offset >= doc_size) {
+        return 0;
+    }
+    size = size < doc_size - offset ? size : doc_size - offset;
+    memcpy(buf, doc_text + offset, size);
+    return size;
+}
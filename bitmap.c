@@ -1,25 +1,129 @@
 #include <assert.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "bitmap.h"
 #include "util.h"
 
+#define BITMAP_BLOCK 32
+
+
+static bool bitmap_rect_touches(const bitmap_rect_t *a,
+        const bitmap_rect_t *b);
+static void bitmap_rect_union(bitmap_rect_t *a, const bitmap_rect_t *b);
+static bool bitmap_clip(const bitmap_t *dst, const bitmap_t *src, int *dst_x,
+        int *dst_y, int *src_x, int *src_y, int *width, int *height);
+static bool bitmap_clip_rect(const bitmap_t *bitmap, int *x, int *y,
+        int *width, int *height);
+static bool bitmap_draw_rop(bitmap_draw_fn draw_fn, bitmap_rop_t *rop);
+static void bitmap_orient_map(bitmap_orient_t orient, int area_width,
+        int area_height, int *x, int *y, int *width, int *height);
+static void bitmap_blit_clipped(bitmap_t *dst, const bitmap_t *src,
+        bitmap_rop_t rop, int dst_x, int dst_y, int src_x, int src_y,
+        int width, int height);
+static void bitmap_blit_flipped(bitmap_t *dst, const bitmap_t *src,
+        bitmap_rop_t rop, bitmap_orient_t orient, int dst_x, int dst_y,
+        int src_x, int src_y, int width, int height);
+static void bitmap_blit_turned(bitmap_t *dst, const bitmap_t *src,
+        bitmap_rop_t rop, bitmap_orient_t orient, int dst_x, int dst_y,
+        int src_x, int src_y, int width, int height);
+static void bitmap_blit_orient_pixels(bitmap_t *dst, const bitmap_t *src,
+        bitmap_draw_fn draw_fn, bitmap_orient_t orient, int dst_x,
+        int dst_y, int src_x, int src_y, int width, int height);
+static void bitmap_rle_run(bitmap_t *dst, bitmap_rop_t rop,
+        const bitmap_rect_t *clip, int dst_x, int dst_y, int width, int *x,
+        int *y, int run);
+static void bitmap_fill(bitmap_t *dst, bitmap_rop_t rop, int x, int y,
+        int width, int height);
+static void bitmap_fill_bytes(uint8_t *d, bitmap_rop_t rop, int count);
+static void bitmap_blit_rle_pixels(bitmap_t *dst, const uint8_t *rle,
+        int width, int height, bitmap_draw_fn draw_fn,
+        const bitmap_rect_t *clip, int dst_x, int dst_y);
+static inline uint8_t *bitmap_addr(const bitmap_t *bitmap, int x, int y,
+        uint8_t *shift);
+static inline uint8_t bitmap_level(const bitmap_t *bitmap, int x, int y);
+static inline uint8_t bitmap_reverse(uint8_t byte, int bpp);
+static inline void bitmap_draw(bitmap_t *bitmap, bitmap_draw_fn draw_fn,
+        int x, int y, uint8_t bit);
+static inline void bitmap_blit_format(bitmap_t *dst, const bitmap_t *src,
+        bitmap_rop_t rop, int dst_x, int dst_y, int src_x, int src_y,
+        int width, int height);
+static inline void bitmap_blit_rows(bitmap_t *dst, const bitmap_t *src,
+        bitmap_rop_t rop, int bpp, int dst_x, int dst_y, int src_x, int src_y,
+        int width, int height);
+static inline void bitmap_blit_expand(bitmap_t *dst, const bitmap_t *src,
+        bitmap_rop_t rop, int bpp, int dst_x, int dst_y, int src_x,
+        int src_y, int width, int height);
+static inline void bitmap_blit_h2v(bitmap_t *dst, const bitmap_t *src,
+        bitmap_rop_t rop, int dst_x, int dst_y, int src_x, int src_y,
+        int width, int height);
+static inline void bitmap_blit_v2v(bitmap_t *dst, const bitmap_t *src,
+        bitmap_rop_t rop, int dst_x, int dst_y, int src_x, int src_y,
+        int width, int height);
+static inline void bitmap_blit_pixels(bitmap_t *dst, const bitmap_t *src,
+        bitmap_rop_t rop, int dst_x, int dst_y, int src_x, int src_y,
+        int width, int height);
+
 
 bitmap_t *bitmap_new(int width, int height)
 {
-    size_t bytes = sizeof(bitmap_t) + DIV_ROUND_UP(width, 8) * height;
+    return bitmap_new_format(width, height, BITMAP_FORMAT_HMSB);
+}
+
+
+bitmap_t *bitmap_new_format(int width, int height, bitmap_format_t format)
+{
+    size_t bytes = sizeof(bitmap_t) + bitmap_data_size(width, height, format);
     bitmap_t *bitmap = calloc(1, bytes);
     assert(bitmap != NULL);
 
     bitmap->width = width;
     bitmap->height = height;
+    bitmap->format = format;
+    bitmap->data = (uint8_t *)(bitmap + 1);
     return bitmap;
 }
 
 
+/* Sets up a bitmap over caller storage of at least bitmap_data_size bytes
+ * and clears it, without allocating. Such a bitmap is not passed to
+ * bitmap_free.
+ */
+void bitmap_init(bitmap_t *bitmap, int width, int height,
+        bitmap_format_t format, uint8_t *data)
+{
+    bitmap->width = width;
+    bitmap->height = height;
+    bitmap->format = format;
+    bitmap->damage = NULL;
+    bitmap->data = data;
+    memset(data, 0, bitmap_data_size(width, height, format));
+}
+
+
+size_t bitmap_data_size(int width, int height, bitmap_format_t format)
+{
+    return BITMAP_DATA_SIZE(width, height, format);
+}
+
+
+int bitmap_bpp(bitmap_format_t format)
+{
+    switch (format) {
+    case BITMAP_FORMAT_GRAY2:
+        return 2;
+    case BITMAP_FORMAT_GRAY4:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+
 void bitmap_free(bitmap_t *bitmap)
 {
     free(bitmap);
@@ -46,24 +150,32 @@ void bitmap_xor_pixel(uint8_t *byte, uint8_t shift, uint8_t bit)
 
 void bitmap_plot(bitmap_t *bitmap, bitmap_draw_fn draw_fn, int x, int y)
 {
-    size_t n = y * DIV_ROUND_UP(bitmap->width, 8) + x / 8; 
-    draw_fn(&bitmap->data[n], 7 - (x & 7), 1);
+    bitmap_draw(bitmap, draw_fn, x, y, 1);
+    bitmap_damage_add(bitmap, x, y, 1, 1);
 }
 
 
 void bitmap_line(bitmap_t *bitmap, bitmap_draw_fn draw_fn, int x1, int y1,
         int x2, int y2)
 {
-    uint16_t stride = DIV_ROUND_UP(bitmap->width, 8);
+    if (y1 == y2) {
+        bitmap_hline(bitmap, draw_fn, MIN(x1, x2), y1, abs(x2 - x1) + 1);
+        return;
+    } else if (x1 == x2) {
+        bitmap_vline(bitmap, draw_fn, x1, MIN(y1, y2), abs(y2 - y1) + 1);
+        return;
+    }
+
     int dx = abs(x2 - x1);
     int sx = x1 < x2 ? 1 : -1;
     int dy = -abs(y2 - y1);
     int sy = y1 < y2 ? 1 : -1;
     int err = dx + dy;
 
+    bitmap_damage_add(bitmap, MIN(x1, x2), MIN(y1, y2), dx + 1, -dy + 1);
+
     while (true) {
-        size_t n = y1 * stride + x1 / 8; 
-        draw_fn(&bitmap->data[n], 7 - (x1 & 7), 1);
+        bitmap_draw(bitmap, draw_fn, x1, y1, 1);
         if (x1 == x2 && y1 == y2) {
             break;
         }
@@ -82,128 +194,1201 @@ void bitmap_line(bitmap_t *bitmap, bitmap_draw_fn draw_fn, int x1, int y1,
 
 void bitmap_invert(bitmap_t *bitmap)
 {
-    uint8_t stride = DIV_ROUND_UP(bitmap->width, 8);
-    uint8_t numbytes = bitmap->height * stride;
-    for (int n = 0; n < numbytes; n++) {
+    size_t numbytes = bitmap_data_size(bitmap->width, bitmap->height,
+            bitmap->format);
+    for (size_t n = 0; n < numbytes; n++) {
         bitmap->data[n] ^= 0xFF;
     }
+    bitmap_damage_add(bitmap, 0, 0, bitmap->width, bitmap->height);
+}
+
+
+void bitmap_hline(bitmap_t *bitmap, bitmap_draw_fn draw_fn, int x, int y,
+        int width)
+{
+    bitmap_fill_rect(bitmap, draw_fn, x, y, width, 1);
+}
+
+
+void bitmap_vline(bitmap_t *bitmap, bitmap_draw_fn draw_fn, int x, int y,
+        int height)
+{
+    bitmap_fill_rect(bitmap, draw_fn, x, y, 1, height);
+}
+
+
+/* Fills a rectangle, clipped to the bitmap. The stock draw functions write
+ * whole bytes between the edge masks, others are called per pixel.
+ */
+void bitmap_fill_rect(bitmap_t *bitmap, bitmap_draw_fn draw_fn, int x, int y,
+        int width, int height)
+{
+    if (!bitmap_clip_rect(bitmap, &x, &y, &width, &height)) {
+        return;
+    }
+    bitmap_damage_add(bitmap, x, y, width, height);
+
+    bitmap_rop_t rop;
+    if (bitmap_draw_rop(draw_fn, &rop)) {
+        bitmap_fill(bitmap, rop, x, y, width, height);
+        return;
+    }
+
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            bitmap_draw(bitmap, draw_fn, x + i, y + j, 1);
+        }
+    }
+}
+
+
+void bitmap_invert_rect(bitmap_t *bitmap, int x, int y, int width,
+        int height)
+{
+    if (!bitmap_clip_rect(bitmap, &x, &y, &width, &height)) {
+        return;
+    }
+    bitmap_damage_add(bitmap, x, y, width, height);
+    bitmap_fill(bitmap, BITMAP_ROP_XOR, x, y, width, height);
 }
 
 
 void bitmap_blit(bitmap_t *dst, const bitmap_t *src, int dst_x, int dst_y,
         int src_x, int src_y, int width, int height)
 {
-    int src_n, dst_n;
-    int src_shift, dst_shift;
+    /* bitmap_blit has always only merged set source pixels into dst, use
+     * bitmap_blit_rop with BITMAP_ROP_COPY to overwrite */
+    bitmap_blit_rop(dst, src, BITMAP_ROP_OR, dst_x, dst_y, src_x, src_y,
+            width, height);
+}
+
+
+void bitmap_blit2(bitmap_t *dst, const bitmap_t *src, bitmap_draw_fn draw_fn,
+        int dst_x, int dst_y, int src_x, int src_y, int width, int height)
+{
+    bitmap_rop_t rop;
+    if (bitmap_draw_rop(draw_fn, &rop)) {
+        bitmap_blit_rop(dst, src, rop, dst_x, dst_y, src_x, src_y, width,
+                height);
+        return;
+    }
+
+    if (!bitmap_clip(dst, src, &dst_x, &dst_y, &src_x, &src_y, &width,
+            &height)) {
+        return;
+    }
+
+    bitmap_damage_add(dst, dst_x, dst_y, width, height);
 
+    /* gray sources are thresholded at half coverage */
+    int threshold = (1 << bitmap_bpp(src->format)) / 2;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            uint8_t level = bitmap_level(src, src_x + x, src_y + y);
+            bitmap_draw(dst, draw_fn, dst_x + x, dst_y + y,
+                    level >= threshold);
+        }
+    }
+}
+
+
+void bitmap_blit_rop(bitmap_t *dst, const bitmap_t *src, bitmap_rop_t rop,
+        int dst_x, int dst_y, int src_x, int src_y, int width, int height)
+{
+    if (!bitmap_clip(dst, src, &dst_x, &dst_y, &src_x, &src_y, &width,
+            &height)) {
+        return;
+    }
+    bitmap_damage_add(dst, dst_x, dst_y, width, height);
+    bitmap_blit_clipped(dst, src, rop, dst_x, dst_y, src_x, src_y, width,
+            height);
+}
+
+
+/* Same as bitmap_blit2, except that the source rectangle is turned or
+ * mirrored by orient before it is placed with its top left corner at dst_x,
+ * dst_y. 1bpp rows are turned 8x8 bits at a time and rows are mirrored a
+ * byte at a time, into a small block that goes through the same row loops
+ * as bitmap_blit_rop. Paged sources, quarter turns of gray sources and
+ * custom draw functions are drawn a pixel at a time.
+ */
+void bitmap_blit_orient(bitmap_t *dst, const bitmap_t *src,
+        bitmap_draw_fn draw_fn, bitmap_orient_t orient, int dst_x, int dst_y,
+        int src_x, int src_y, int width, int height)
+{
     width = width ? width : src->width;
     height = height ? height : src->height;
+    bool turned = orient == BITMAP_ORIENT_ROTATE_90 ||
+            orient == BITMAP_ORIENT_ROTATE_270;
+
+    /* the rectangle is clipped to src, turned, clipped to dst and turned
+     * back, so that both ends stay in bounds */
+    int x = MAX(src_x, 0) - src_x;
+    int y = MAX(src_y, 0) - src_y;
+    int w = MIN(src_x + width, (int)src->width) - src_x - x;
+    int h = MIN(src_y + height, (int)src->height) - src_y - y;
+    if (w <= 0 || h <= 0) {
+        return;
+    }
+    if (orient == BITMAP_ORIENT_NONE) {
+        bitmap_blit2(dst, src, draw_fn, dst_x + x, dst_y + y, src_x + x,
+                src_y + y, w, h);
+        return;
+    }
+    bitmap_orient_map(orient, width, height, &x, &y, &w, &h);
+    int x1 = MAX(dst_x + x, 0);
+    int y1 = MAX(dst_y + y, 0);
+    int x2 = MIN(dst_x + x + w, (int)dst->width);
+    int y2 = MIN(dst_y + y + h, (int)dst->height);
+    if (x2 <= x1 || y2 <= y1) {
+        return;
+    }
+    bitmap_damage_add(dst, x1, y1, x2 - x1, y2 - y1);
+
+    x = x1 - dst_x;
+    y = y1 - dst_y;
+    w = x2 - x1;
+    h = y2 - y1;
+    bitmap_orient_t inverse = orient == BITMAP_ORIENT_ROTATE_90 ?
+            BITMAP_ORIENT_ROTATE_270 : orient == BITMAP_ORIENT_ROTATE_270 ?
+            BITMAP_ORIENT_ROTATE_90 : orient;
+    bitmap_orient_map(inverse, turned ? height : width,
+            turned ? width : height, &x, &y, &w, &h);
+    src_x += x;
+    src_y += y;
 
-    if (dst_x < 0) {
-        src_x += dst_x;
-        width += dst_x;
-        dst_x = 0;
-    } else if (dst_x > dst->width) {
-        width = dst->width - dst_x;
+    bitmap_rop_t rop;
+    if (!bitmap_draw_rop(draw_fn, &rop) ||
+            src->format == BITMAP_FORMAT_VLSB ||
+            (turned && src->format != BITMAP_FORMAT_HMSB)) {
+        bitmap_blit_orient_pixels(dst, src, draw_fn, orient, x1, y1, src_x,
+                src_y, w, h);
+    } else if (turned) {
+        bitmap_blit_turned(dst, src, rop, orient, x1, y1, src_x, src_y, w,
+                h);
+    } else {
+        bitmap_blit_flipped(dst, src, rop, orient, x1, y1, src_x, src_y, w,
+                h);
     }
+}
+
+
+/* Converts a rectangle in the view of bitmap turned or mirrored by orient,
+ * which is what a panel mounted that way shows, into bitmap coordinates.
+ */
+void bitmap_orient_rect(const bitmap_t *bitmap, bitmap_orient_t orient,
+        int *x, int *y, int *width, int *height)
+{
+    bool turned = orient == BITMAP_ORIENT_ROTATE_90 ||
+            orient == BITMAP_ORIENT_ROTATE_270;
+    bitmap_orient_map(orient, turned ? bitmap->height : bitmap->width,
+            turned ? bitmap->width : bitmap->height, x, y, width, height);
+}
+
+
+/* Draws a run-length encoded 1bpp image, as stored for compressed font
+ * glyphs. Each byte holds a count of clear pixels in the high nibble
+ * followed by a count of set pixels in the low nibble, scanning rows left
+ * to right, and a zero byte ends the image. Runs are drawn straight into
+ * dst; with the stock draw functions clear runs are skipped outright and
+ * adjacent set runs are merged so long runs become whole byte fills.
+ */
+void bitmap_blit_rle(bitmap_t *dst, const uint8_t *rle, int width, int height,
+        bitmap_draw_fn draw_fn, int dst_x, int dst_y)
+{
+    bitmap_blit_rle_clip(dst, rle, width, height, draw_fn, dst_x, dst_y,
+            NULL);
+}
+
 
-    if (dst_y < 0) {
-        src_y += dst_y;
-        height += dst_y;
-        dst_y = 0;
-    } else if (dst_y > dst->height) {
-        height = dst->height - dst_y;
+/* Same as bitmap_blit_rle, but only pixels inside clip are drawn. A NULL
+ * clip is the whole of dst. Decoding stops at the bottom of the clip.
+ */
+void bitmap_blit_rle_clip(bitmap_t *dst, const uint8_t *rle, int width,
+        int height, bitmap_draw_fn draw_fn, int dst_x, int dst_y,
+        const bitmap_rect_t *clip)
+{
+    int cx = clip ? clip->x : 0;
+    int cy = clip ? clip->y : 0;
+    int cw = clip ? clip->width : dst->width;
+    int ch = clip ? clip->height : dst->height;
+    if (width <= 0 || !bitmap_clip_rect(dst, &cx, &cy, &cw, &ch)) {
+        return;
     }
+    bitmap_rect_t rect = { cx, cy, cw, ch };
 
-    if (width < 0) {
+    int x1 = MAX(dst_x, cx);
+    int y1 = MAX(dst_y, cy);
+    int x2 = MIN(dst_x + width, cx + cw);
+    int y2 = MIN(dst_y + height, cy + ch);
+    if (x2 <= x1 || y2 <= y1) {
         return;
     }
+    bitmap_damage_add(dst, x1, y1, x2 - x1, y2 - y1);
 
-    if (height < 0) {
+    bitmap_rop_t rop;
+    if (!bitmap_draw_rop(draw_fn, &rop)) {
+        bitmap_blit_rle_pixels(dst, rle, width, height, draw_fn, &rect,
+                dst_x, dst_y);
         return;
     }
 
-    int src_stride = DIV_ROUND_UP(src->width, 8);
-    int dst_stride = DIV_ROUND_UP(dst->width, 8);
+    int x = 0;
+    int y = 0;
+    int run = 0;
+    for (; *rle && dst_y + y < y2; rle++) {
+        int zeros = *rle >> 4;
+        int ones = *rle & 0x0F;
+        if (zeros && run) {
+            bitmap_rle_run(dst, rop, &rect, dst_x, dst_y, width, &x, &y,
+                    run);
+            run = 0;
+        }
+        x += zeros;
+        while (x >= width) {
+            x -= width;
+            y++;
+        }
+        run += ones;
+    }
+    if (run) {
+        bitmap_rle_run(dst, rop, &rect, dst_x, dst_y, width, &x, &y, run);
+    }
+}
+
+
+/* Adds a rectangle to the bitmap's damage list, if it has one. Rectangles
+ * that overlap or touch are merged, and once the list is full the new area
+ * is folded into whichever rectangle grows the least.
+ */
+void bitmap_damage_add(bitmap_t *bitmap, int x, int y, int width, int height)
+{
+    bitmap_damage_t *damage = bitmap->damage;
+    if (damage == NULL) {
+        return;
+    }
+
+    int x2 = MIN(x + width, (int)bitmap->width);
+    int y2 = MIN(y + height, (int)bitmap->height);
+    x = MAX(x, 0);
+    y = MAX(y, 0);
+    if (x2 <= x || y2 <= y) {
+        return;
+    }
+    bitmap_rect_t rect = { x, y, x2 - x, y2 - y };
+
+    int i = 0;
+    while (i < damage->count) {
+        bitmap_rect_t *r = &damage->rects[i];
+        if (bitmap_rect_touches(r, &rect)) {
+            bitmap_rect_union(&rect, r);
+            *r = damage->rects[--damage->count];
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+
+    if (damage->count < BITMAP_DAMAGE_RECTS) {
+        damage->rects[damage->count++] = rect;
+        return;
+    }
+
+    int best = 0;
+    int best_growth = INT_MAX;
+    for (i = 0; i < damage->count; i++) {
+        bitmap_rect_t merged = damage->rects[i];
+        bitmap_rect_union(&merged, &rect);
+        int growth = merged.width * merged.height -
+                damage->rects[i].width * damage->rects[i].height;
+        if (growth < best_growth) {
+            best = i;
+            best_growth = growth;
+        }
+    }
+    bitmap_rect_union(&rect, &damage->rects[best]);
+    damage->rects[best] = damage->rects[--damage->count];
+    bitmap_damage_add(bitmap, rect.x, rect.y, rect.width, rect.height);
+}
+
+
+void bitmap_damage_clear(bitmap_damage_t *damage)
+{
+    damage->count = 0;
+}
+
+
+static bool bitmap_rect_touches(const bitmap_rect_t *a, const bitmap_rect_t *b)
+{
+    return a->x <= b->x + b->width && b->x <= a->x + a->width &&
+            a->y <= b->y + b->height && b->y <= a->y + a->height;
+}
+
+
+static void bitmap_rect_union(bitmap_rect_t *a, const bitmap_rect_t *b)
+{
+    int x2 = MAX(a->x + a->width, b->x + b->width);
+    int y2 = MAX(a->y + a->height, b->y + b->height);
+    a->x = MIN(a->x, b->x);
+    a->y = MIN(a->y, b->y);
+    a->width = x2 - a->x;
+    a->height = y2 - a->y;
+}
+
+
+static bool bitmap_clip(const bitmap_t *dst, const bitmap_t *src, int *dst_x,
+        int *dst_y, int *src_x, int *src_y, int *width, int *height)
+{
+    *width = *width ? *width : src->width;
+    *height = *height ? *height : src->height;
+
+    if (*dst_x < 0) {
+        *src_x -= *dst_x;
+        *width += *dst_x;
+        *dst_x = 0;
+    }
+    if (*dst_x + *width > dst->width) {
+        *width = dst->width - *dst_x;
+    }
+    if (*src_x + *width > src->width) {
+        *width = src->width - *src_x;
+    }
+
+    if (*dst_y < 0) {
+        *src_y -= *dst_y;
+        *height += *dst_y;
+        *dst_y = 0;
+    }
+    if (*dst_y + *height > dst->height) {
+        *height = dst->height - *dst_y;
+    }
+    if (*src_y + *height > src->height) {
+        *height = src->height - *src_y;
+    }
+
+    return *width > 0 && *height > 0 && *src_x >= 0 && *src_y >= 0;
+}
+
+
+static bool bitmap_clip_rect(const bitmap_t *bitmap, int *x, int *y,
+        int *width, int *height)
+{
+    if (*x < 0) {
+        *width += *x;
+        *x = 0;
+    }
+    if (*y < 0) {
+        *height += *y;
+        *y = 0;
+    }
+    *width = MIN(*width, bitmap->width - *x);
+    *height = MIN(*height, bitmap->height - *y);
+    return *width > 0 && *height > 0;
+}
+
+
+/* Maps the stock draw functions to the rop that does the same to a set
+ * source pixel. Returns false for any other draw function.
+ */
+static bool bitmap_draw_rop(bitmap_draw_fn draw_fn, bitmap_rop_t *rop)
+{
+    if (draw_fn == bitmap_set_pixel) {
+        *rop = BITMAP_ROP_OR;
+    } else if (draw_fn == bitmap_clear_pixel) {
+        *rop = BITMAP_ROP_ANDNOT;
+    } else if (draw_fn == bitmap_xor_pixel) {
+        *rop = BITMAP_ROP_XOR;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+
+/* Moves x, y, width, height within an area of area_width by area_height to
+ * where it lands once the area is turned or mirrored by orient.
+ */
+static void bitmap_orient_map(bitmap_orient_t orient, int area_width,
+        int area_height, int *x, int *y, int *width, int *height)
+{
+    int x0 = *x;
+    int y0 = *y;
+    int w = *width;
+    int h = *height;
+    switch (orient) {
+    case BITMAP_ORIENT_NONE:
+        break;
+    case BITMAP_ORIENT_ROTATE_90:
+        *x = area_height - y0 - h;
+        *y = x0;
+        *width = h;
+        *height = w;
+        break;
+    case BITMAP_ORIENT_ROTATE_180:
+        *x = area_width - x0 - w;
+        *y = area_height - y0 - h;
+        break;
+    case BITMAP_ORIENT_ROTATE_270:
+        *x = y0;
+        *y = area_width - x0 - w;
+        *width = h;
+        *height = w;
+        break;
+    case BITMAP_ORIENT_FLIP_X:
+        *x = area_width - x0 - w;
+        break;
+    case BITMAP_ORIENT_FLIP_Y:
+        *y = area_height - y0 - h;
+        break;
+    }
+}
+
+
+/* Blits an already clipped rectangle without adding damage. The rop is
+ * resolved here, once, so each row loop is specialized.
+ */
+static void bitmap_blit_clipped(bitmap_t *dst, const bitmap_t *src,
+        bitmap_rop_t rop, int dst_x, int dst_y, int src_x, int src_y,
+        int width, int height)
+{
+    switch (rop) {
+    case BITMAP_ROP_COPY:
+        bitmap_blit_format(dst, src, BITMAP_ROP_COPY, dst_x, dst_y, src_x,
+                src_y, width, height);
+        break;
+    case BITMAP_ROP_OR:
+        bitmap_blit_format(dst, src, BITMAP_ROP_OR, dst_x, dst_y, src_x,
+                src_y, width, height);
+        break;
+    case BITMAP_ROP_ANDNOT:
+        bitmap_blit_format(dst, src, BITMAP_ROP_ANDNOT, dst_x, dst_y, src_x,
+                src_y, width, height);
+        break;
+    case BITMAP_ROP_XOR:
+        bitmap_blit_format(dst, src, BITMAP_ROP_XOR, dst_x, dst_y, src_x,
+                src_y, width, height);
+        break;
+    }
+}
+
+
+static inline uint8_t *bitmap_addr(const bitmap_t *bitmap, int x, int y,
+        uint8_t *shift)
+{
+    if (bitmap->format == BITMAP_FORMAT_VLSB) {
+        *shift = y & 7;
+        return &bitmap->data[(y / 8) * bitmap->width + x];
+    }
+    int bpp = bitmap_bpp(bitmap->format);
+    int bit = x * bpp;
+    *shift = 8 - bpp - (bit & 7);
+    return &bitmap->data[y * DIV_ROUND_UP(bitmap->width * bpp, 8) + bit / 8];
+}
+
+
+static inline uint8_t bitmap_level(const bitmap_t *bitmap, int x, int y)
+{
+    uint8_t shift;
+    const uint8_t *byte = bitmap_addr(bitmap, x, y, &shift);
+    return (*byte >> shift) & ((1 << bitmap_bpp(bitmap->format)) - 1);
+}
+
+
+/* Reverses the order of the pixels in a byte of bpp bit pixels.
+ */
+static inline uint8_t bitmap_reverse(uint8_t byte, int bpp)
+{
+    if (bpp == 1) {
+        byte = (byte & 0xAA) >> 1 | (byte & 0x55) << 1;
+    }
+    if (bpp <= 2) {
+        byte = (byte & 0xCC) >> 2 | (byte & 0x33) << 2;
+    }
+    return byte >> 4 | byte << 4;
+}
+
+
+/* Applies draw_fn to every bit of a pixel, so the stock draw functions set,
+ * clear or invert whole gray levels.
+ */
+static inline void bitmap_draw(bitmap_t *bitmap, bitmap_draw_fn draw_fn,
+        int x, int y, uint8_t bit)
+{
+    uint8_t shift;
+    uint8_t *byte = bitmap_addr(bitmap, x, y, &shift);
+    int bpp = bitmap_bpp(bitmap->format);
+    for (int i = 0; i < bpp; i++) {
+        draw_fn(byte, shift + i, bit);
+    }
+}
+
+
+/* Transposes an 8x8 bit matrix (Hacker's Delight, 7-3): bit 7 - j of in[i]
+ * becomes bit 7 - i of out[j].
+ */
+static inline void bitmap_transpose8(const uint8_t in[8], uint8_t out[8])
+{
+    uint64_t x = 0;
+    for (int i = 0; i < 8; i++) {
+        x = (x << 8) | in[i];
+    }
+
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x = x ^ t ^ (t << 28);
+
+    for (int i = 7; i >= 0; i--) {
+        out[i] = x;
+        x >>= 8;
+    }
+}
+
+
+/* Returns a mask of the bpp bit fields of a word where d >= s. Alternate
+ * fields are moved into lanes twice their width, so each subtraction has a
+ * spare bit to borrow from.
+ */
+static inline uint32_t bitmap_field_ge(uint32_t d, uint32_t s, int bpp)
+{
+    uint32_t lane = bpp == 2 ? 0x33333333 : 0x0F0F0F0F;
+    uint32_t top = bpp == 2 ? 0x44444444 : 0x10101010;
+    uint32_t field = (1 << bpp) - 1;
+
+    uint32_t even = (((d & lane) | top) - (s & lane)) & top;
+    uint32_t odd = ((((d >> bpp) & lane) | top) - ((s >> bpp) & lane)) & top;
+    return (even >> bpp) * field | ((odd >> bpp) * field) << bpp;
+}
+
+
+/* For gray levels OR keeps the darker of the two (the most ink) and ANDNOT
+ * limits dst to the inverse of src, which is what they do bitwise at 1bpp.
+ */
+static inline uint32_t bitmap_rop_apply32(bitmap_rop_t rop, int bpp,
+        uint32_t d, uint32_t s)
+{
+    uint32_t ge;
+    switch (rop) {
+    case BITMAP_ROP_COPY:
+        return s;
+    case BITMAP_ROP_OR:
+        if (bpp == 1) {
+            return d | s;
+        }
+        ge = bitmap_field_ge(d, s, bpp);
+        return (d & ge) | (s & ~ge);
+    case BITMAP_ROP_ANDNOT:
+        if (bpp == 1) {
+            return d & ~s;
+        }
+        ge = bitmap_field_ge(d, ~s, bpp);
+        return (~s & ge) | (d & ~ge);
+    case BITMAP_ROP_XOR:
+        return d ^ s;
+    }
+    return d;
+}
+
+
+static inline uint8_t bitmap_rop_apply(bitmap_rop_t rop, int bpp, uint8_t d,
+        uint8_t s, uint8_t mask)
+{
+    return (d & ~mask) | (bitmap_rop_apply32(rop, bpp, d, s) & mask);
+}
+
+
+static inline uint8_t bitmap_fetch(const uint8_t *row, int n, int stride)
+{
+    return n >= 0 && n < stride ? row[n] : 0;
+}
+
+
+static inline __attribute__((always_inline)) void bitmap_blit_format(
+        bitmap_t *dst, const bitmap_t *src, bitmap_rop_t rop, int dst_x,
+        int dst_y, int src_x, int src_y, int width, int height)
+{
+    if (src->format == BITMAP_FORMAT_HMSB) {
+        if (dst->format == BITMAP_FORMAT_HMSB) {
+            bitmap_blit_rows(dst, src, rop, 1, dst_x, dst_y, src_x, src_y,
+                    width, height);
+        } else if (dst->format == BITMAP_FORMAT_VLSB) {
+            bitmap_blit_h2v(dst, src, rop, dst_x, dst_y, src_x, src_y,
+                    width, height);
+        } else if (dst->format == BITMAP_FORMAT_GRAY2) {
+            bitmap_blit_expand(dst, src, rop, 2, dst_x, dst_y, src_x, src_y,
+                    width, height);
+        } else {
+            bitmap_blit_expand(dst, src, rop, 4, dst_x, dst_y, src_x, src_y,
+                    width, height);
+        }
+    } else if (src->format == BITMAP_FORMAT_VLSB &&
+            dst->format == BITMAP_FORMAT_VLSB) {
+        bitmap_blit_v2v(dst, src, rop, dst_x, dst_y, src_x, src_y, width,
+                height);
+    } else if (src->format == BITMAP_FORMAT_GRAY2 &&
+            dst->format == BITMAP_FORMAT_GRAY2) {
+        bitmap_blit_rows(dst, src, rop, 2, dst_x, dst_y, src_x, src_y,
+                width, height);
+    } else if (src->format == BITMAP_FORMAT_GRAY4 &&
+            dst->format == BITMAP_FORMAT_GRAY4) {
+        bitmap_blit_rows(dst, src, rop, 4, dst_x, dst_y, src_x, src_y,
+                width, height);
+    } else {
+        bitmap_blit_pixels(dst, src, rop, dst_x, dst_y, src_x, src_y, width,
+                height);
+    }
+}
+
+
+/* Rows are processed a destination byte at a time: the source is read as a
+ * 16 bit window shifted into destination alignment, the first and last bytes
+ * of the span are masked, and the interior is handled four bytes at a time.
+ * Gray formats go through the same loop in bit units, with the rop applied
+ * to every pixel field of a byte or word at once.
+ */
+static inline __attribute__((always_inline)) void bitmap_blit_rows(
+        bitmap_t *dst, const bitmap_t *src, bitmap_rop_t rop, int bpp,
+        int dst_x, int dst_y, int src_x, int src_y, int width, int height)
+{
+    int src_stride = DIV_ROUND_UP(src->width * bpp, 8);
+    int dst_stride = DIV_ROUND_UP(dst->width * bpp, 8);
+    dst_x *= bpp;
+    src_x *= bpp;
+    width *= bpp;
+
+    int src_bit = src_x - (dst_x & 7);
+    int shift = src_bit & 7;
+    int src_n0 = (src_bit - shift) / 8;
+    int dst_n0 = dst_x / 8;
+    int count = (dst_x + width - 1) / 8 - dst_n0 + 1;
+    uint8_t first_mask = 0xFF >> (dst_x & 7);
+    uint8_t last_mask = 0xFF << (7 - ((dst_x + width - 1) & 7));
+    if (count == 1) {
+        first_mask &= last_mask;
+    }
 
     for (int y = 0; y < height; y++) {
-        src_n = (src_y + y) * src_stride + src_x / 8;
-        src_shift = 7 - (src_x % 8);
-        dst_n = (dst_y + y) * dst_stride + dst_x / 8;
-        dst_shift = 7 - (dst_x % 8);
+        const uint8_t *src_row = &src->data[(src_y + y) * src_stride];
+        uint8_t *d = &dst->data[(dst_y + y) * dst_stride + dst_n0];
+        int src_n = src_n0;
 
-        for (int x = 0; x < width; x++) {
-            uint8_t bit = (src->data[src_n] >> src_shift) & 1;
-            if (bit) {
-                dst->data[dst_n] |= bit << dst_shift;
-            } else {
-                dst->data[dst_n] &= ~(bit << dst_shift);
+        uint8_t s = bitmap_fetch(src_row, src_n, src_stride) << shift;
+        if (shift) {
+            s |= bitmap_fetch(src_row, src_n + 1, src_stride) >> (8 - shift);
+        }
+        *d = bitmap_rop_apply(rop, bpp, *d, s, first_mask);
+        if (count == 1) {
+            continue;
+        }
+        d++;
+        src_n++;
+
+        /* interior bytes are fully covered, so every source byte they read
+         * lies inside the row */
+        const uint8_t *sp = &src_row[src_n];
+        int n = count - 2;
+        if (shift == 0) {
+            for (; n >= 4; n -= 4, sp += 4, d += 4) {
+                uint32_t sw, dw;
+                memcpy(&sw, sp, 4);
+                memcpy(&dw, d, 4);
+                dw = bitmap_rop_apply32(rop, bpp, dw, sw);
+                memcpy(d, &dw, 4);
             }
-            if (src_shift-- == 0) {
-                src_shift = 7;
-                src_n++;
+            for (; n > 0; n--, sp++, d++) {
+                *d = bitmap_rop_apply(rop, bpp, *d, *sp, 0xFF);
             }
-            if (dst_shift-- == 0) {
-                dst_shift = 7;
-                dst_n++;
+        } else {
+            for (; n >= 4; n -= 4, sp += 4, d += 4) {
+                uint32_t sw = ((uint32_t)sp[0] << 24) | (sp[1] << 16) |
+                        (sp[2] << 8) | sp[3];
+                sw = (sw << shift) | (sp[4] >> (8 - shift));
+                uint8_t sb[4] = { sw >> 24, sw >> 16, sw >> 8, sw };
+                uint32_t sw_ne, dw;
+                memcpy(&sw_ne, sb, 4);
+                memcpy(&dw, d, 4);
+                dw = bitmap_rop_apply32(rop, bpp, dw, sw_ne);
+                memcpy(d, &dw, 4);
+            }
+            for (; n > 0; n--, sp++, d++) {
+                s = (sp[0] << shift) | (sp[1] >> (8 - shift));
+                *d = bitmap_rop_apply(rop, bpp, *d, s, 0xFF);
             }
         }
+
+        src_n = sp - src_row;
+        s = bitmap_fetch(src_row, src_n, src_stride) << shift;
+        if (shift) {
+            s |= bitmap_fetch(src_row, src_n + 1, src_stride) >> (8 - shift);
+        }
+        *d = bitmap_rop_apply(rop, bpp, *d, s, last_mask);
     }
 }
 
 
-void bitmap_blit2(bitmap_t *dst, const bitmap_t *src, bitmap_draw_fn draw_fn,
+/* 1bpp source onto a gray destination: for each destination byte the source
+ * bits of its pixels are taken from a 16 bit window and widened to full
+ * levels through a small table.
+ */
+static inline __attribute__((always_inline)) void bitmap_blit_expand(
+        bitmap_t *dst, const bitmap_t *src, bitmap_rop_t rop, int bpp,
         int dst_x, int dst_y, int src_x, int src_y, int width, int height)
 {
-    int src_n, dst_n;
-    int src_shift, dst_shift;
+    static const uint8_t expand2[16] = {
+        0x00, 0x03, 0x0C, 0x0F, 0x30, 0x33, 0x3C, 0x3F,
+        0xC0, 0xC3, 0xCC, 0xCF, 0xF0, 0xF3, 0xFC, 0xFF,
+    };
+    static const uint8_t expand4[4] = { 0x00, 0x0F, 0xF0, 0xFF };
+    int per_byte = 8 / bpp;
+    int src_stride = DIV_ROUND_UP(src->width, 8);
+    int dst_stride = DIV_ROUND_UP(dst->width * bpp, 8);
 
-    width = width ? width : src->width;
-    height = height ? height : src->height;
+    int x0 = dst_x - dst_x % per_byte;
+    int count = (dst_x + width - 1) / per_byte - x0 / per_byte + 1;
+    uint8_t first_mask = 0xFF >> ((dst_x - x0) * bpp);
+    uint8_t last_mask = 0xFF << (8 - ((dst_x + width - 1) % per_byte + 1) *
+            bpp);
+    if (count == 1) {
+        first_mask &= last_mask;
+    }
+
+    for (int y = 0; y < height; y++) {
+        const uint8_t *src_row = &src->data[(src_y + y) * src_stride];
+        uint8_t *d = &dst->data[(dst_y + y) * dst_stride + x0 / per_byte];
+        int bit = src_x - (dst_x - x0);
+
+        for (int i = 0; i < count; i++, d++, bit += per_byte) {
+            int shift = bit & 7;
+            int n = (bit - shift) / 8;
+            uint16_t window = bitmap_fetch(src_row, n, src_stride) << 8 |
+                    bitmap_fetch(src_row, n + 1, src_stride);
+            uint8_t bits = (uint16_t)(window << shift) >> (16 - per_byte);
+            uint8_t s = bpp == 2 ? expand2[bits] : expand4[bits];
+            uint8_t mask = i == 0 ? first_mask : i == count - 1 ? last_mask :
+                    0xFF;
+            *d = bitmap_rop_apply(rop, bpp, *d, s, mask);
+        }
+    }
+}
+
+
+/* Horizontal source onto a paged destination, for glyphs drawn straight
+ * into a controller framebuffer. Each 8x8 block of source bits is gathered
+ * row-wise, transposed into eight column bytes and written with the page
+ * mask.
+ */
+static inline __attribute__((always_inline)) void bitmap_blit_h2v(
+        bitmap_t *dst, const bitmap_t *src, bitmap_rop_t rop, int dst_x,
+        int dst_y, int src_x, int src_y, int width, int height)
+{
+    int src_stride = DIV_ROUND_UP(src->width, 8);
+    int first_page = dst_y / 8;
+    int last_page = (dst_y + height - 1) / 8;
+
+    for (int page = first_page; page <= last_page; page++) {
+        int y0 = MAX(dst_y, page * 8);
+        int y1 = MIN(dst_y + height, page * 8 + 8);
+        uint8_t mask = (0xFF << (y0 & 7)) & (0xFF >> (7 - ((y1 - 1) & 7)));
+        uint8_t *d = &dst->data[page * dst->width + dst_x];
+
+        for (int x = 0; x < width; x += 8) {
+            int bit = src_x + x;
+            int shift = bit & 7;
+            uint8_t rows[8] = { 0 };
+
+            /* rows are stored bottom up so the transpose puts the top row
+             * in bit 0 */
+            for (int y = y0; y < y1; y++) {
+                const uint8_t *row = &src->data[(src_y + y - dst_y) *
+                        src_stride];
+                uint8_t s = bitmap_fetch(row, bit / 8, src_stride) << shift;
+                if (shift) {
+                    s |= bitmap_fetch(row, bit / 8 + 1, src_stride) >>
+                            (8 - shift);
+                }
+                rows[7 - (y & 7)] = s;
+            }
+
+            uint8_t cols[8];
+            bitmap_transpose8(rows, cols);
+            int count = MIN(8, width - x);
+            for (int c = 0; c < count; c++) {
+                d[x + c] = bitmap_rop_apply(rop, 1, d[x + c], cols[c], mask);
+            }
+        }
+    }
+}
+
+
+/* Paged source onto a paged destination: each destination page is built
+ * from the two source pages it straddles, a column at a time.
+ */
+static inline __attribute__((always_inline)) void bitmap_blit_v2v(
+        bitmap_t *dst, const bitmap_t *src, bitmap_rop_t rop, int dst_x,
+        int dst_y, int src_x, int src_y, int width, int height)
+{
+    int src_pages = DIV_ROUND_UP(src->height, 8);
+    int first_page = dst_y / 8;
+    int last_page = (dst_y + height - 1) / 8;
+
+    for (int page = first_page; page <= last_page; page++) {
+        int y0 = MAX(dst_y, page * 8);
+        int y1 = MIN(dst_y + height, page * 8 + 8);
+        uint8_t mask = (0xFF << (y0 & 7)) & (0xFF >> (7 - ((y1 - 1) & 7)));
+        uint8_t *d = &dst->data[page * dst->width + dst_x];
+
+        int src_bit = page * 8 - dst_y + src_y;
+        int shift = src_bit & 7;
+        int src_page = (src_bit - shift) / 8;
+        const uint8_t *s0 = NULL;
+        const uint8_t *s1 = NULL;
+        if (src_page >= 0 && src_page < src_pages) {
+            s0 = &src->data[src_page * src->width + src_x];
+        }
+        if (shift && src_page + 1 >= 0 && src_page + 1 < src_pages) {
+            s1 = &src->data[(src_page + 1) * src->width + src_x];
+        }
+
+        if (s0 && s1) {
+            for (int x = 0; x < width; x++) {
+                uint8_t s = (s0[x] >> shift) | (s1[x] << (8 - shift));
+                d[x] = bitmap_rop_apply(rop, 1, d[x], s, mask);
+            }
+        } else if (s0) {
+            for (int x = 0; x < width; x++) {
+                d[x] = bitmap_rop_apply(rop, 1, d[x], s0[x] >> shift, mask);
+            }
+        } else if (s1) {
+            for (int x = 0; x < width; x++) {
+                d[x] = bitmap_rop_apply(rop, 1, d[x], s1[x] << (8 - shift),
+                        mask);
+            }
+        }
+    }
+}
+
+
+static inline __attribute__((always_inline)) void bitmap_blit_pixels(
+        bitmap_t *dst, const bitmap_t *src, bitmap_rop_t rop, int dst_x,
+        int dst_y, int src_x, int src_y, int width, int height)
+{
+    /* levels are rescaled, rounding, between the two depths */
+    int dst_bpp = bitmap_bpp(dst->format);
+    int src_max = (1 << bitmap_bpp(src->format)) - 1;
+    int dst_max = (1 << dst_bpp) - 1;
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            uint8_t level = bitmap_level(src, src_x + x, src_y + y);
+            level = (level * dst_max + src_max / 2) / src_max;
+            uint8_t shift;
+            uint8_t *d = bitmap_addr(dst, dst_x + x, dst_y + y, &shift);
+            *d = bitmap_rop_apply(rop, dst_bpp, *d, level << shift,
+                    dst_max << shift);
+        }
+    }
+}
+
+
+/* Mirrors row based sources in blocks of BITMAP_BLOCK / 2 bytes of pixels
+ * by 8 rows. The bytes a block spans are copied into a small bitmap of the
+ * source's format, reversed with their pixels when mirroring left to right
+ * and with the rows in reverse order when mirroring top to bottom, and the
+ * block is drawn from there.
+ */
+static void bitmap_blit_flipped(bitmap_t *dst, const bitmap_t *src,
+        bitmap_rop_t rop, bitmap_orient_t orient, int dst_x, int dst_y,
+        int src_x, int src_y, int width, int height)
+{
+    int bpp = bitmap_bpp(src->format);
+    int per_byte = 8 / bpp;
+    int src_stride = DIV_ROUND_UP(src->width * bpp, 8);
+    bool flip_x = orient != BITMAP_ORIENT_FLIP_Y;
+    bool flip_y = orient != BITMAP_ORIENT_FLIP_X;
+    int block_width = BITMAP_BLOCK / 2 * per_byte;
+    uint8_t data[8 * (BITMAP_BLOCK / 2 + 1)];
+    bitmap_t block = {
+        .height = 8,
+        .format = src->format,
+        .data = data,
+    };
+
+    for (int u = 0; u < width; u += block_width) {
+        int w = MIN(block_width, width - u);
+        int n0 = (src_x + u) / per_byte;
+        int stride = (src_x + u + w - 1) / per_byte - n0 + 1;
+        block.width = stride * per_byte;
+        int block_x = src_x + u - n0 * per_byte;
+        if (flip_x) {
+            block_x = block.width - block_x - w;
+        }
+        int x = flip_x ? width - u - w : u;
+
+        for (int v = 0; v < height; v += 8) {
+            int h = MIN(8, height - v);
+            for (int i = 0; i < h; i++) {
+                int row = src_y + (flip_y ? height - 1 - v - i : v + i);
+                const uint8_t *s = &src->data[row * src_stride + n0];
+                uint8_t *d = &data[i * stride];
+                if (flip_x) {
+                    for (int n = 0; n < stride; n++) {
+                        d[n] = bitmap_reverse(s[stride - 1 - n], bpp);
+                    }
+                } else {
+                    memcpy(d, s, stride);
+                }
+            }
+            bitmap_blit_clipped(dst, &block, rop, dst_x + x, dst_y + v,
+                    block_x, 0, w, h);
+        }
+    }
+}
+
+
+/* Turns 1bpp sources a quarter in blocks of BITMAP_BLOCK square. For a row
+ * based dst every 8x8 tile of a block is transposed into a small HMSB
+ * bitmap. For a paged dst a source byte already is a column of a page, so
+ * the bytes are only moved, and bit reversed when turning clockwise. The
+ * block is then drawn like any other source.
+ */
+static void bitmap_blit_turned(bitmap_t *dst, const bitmap_t *src,
+        bitmap_rop_t rop, bitmap_orient_t orient, int dst_x, int dst_y,
+        int src_x, int src_y, int width, int height)
+{
+    const int size = BITMAP_BLOCK;
+    int src_stride = DIV_ROUND_UP(src->width, 8);
+    bool clockwise = orient == BITMAP_ORIENT_ROTATE_90;
+    bool paged = dst->format == BITMAP_FORMAT_VLSB;
+    uint8_t data[BITMAP_BLOCK * BITMAP_BLOCK / 8];
+    bitmap_t block = {
+        .width = size,
+        .height = size,
+        .format = paged ? BITMAP_FORMAT_VLSB : BITMAP_FORMAT_HMSB,
+        .data = data,
+    };
 
-    if (dst_x < 0) {
-        src_x += dst_x;
-        width += dst_x;
-        dst_x = 0;
-    } else if (dst_x > dst->width) {
-        width = dst->width - dst_x;
+    for (int v = 0; v < height; v += size) {
+        int h = MIN(size, height - v);
+        for (int u = 0; u < width; u += size) {
+            int w = MIN(size, width - u);
+
+            /* source pixel a, b of the block lands on size - 1 - b, a when
+             * turning clockwise and on b, size - 1 - a otherwise */
+            for (int j = 0; j < w; j += 8) {
+                int bit = src_x + u + j;
+                int shift = bit & 7;
+                for (int i = 0; i < h; i += 8) {
+                    uint8_t rows[8] = { 0 };
+                    int count = MIN(8, h - i);
+                    for (int k = 0; k < count; k++) {
+                        const uint8_t *row = &src->data[(src_y + v + i + k) *
+                                src_stride];
+                        rows[k] = bitmap_fetch(row, bit / 8, src_stride) <<
+                                shift;
+                        if (shift) {
+                            rows[k] |= bitmap_fetch(row, bit / 8 + 1,
+                                    src_stride) >> (8 - shift);
+                        }
+                    }
+
+                    if (paged && clockwise) {
+                        for (int k = 0; k < 8; k++) {
+                            data[j / 8 * size + size - 1 - i - k] =
+                                    bitmap_reverse(rows[k], 1);
+                        }
+                    } else if (paged) {
+                        for (int k = 0; k < 8; k++) {
+                            data[(size - 8 - j) / 8 * size + i + k] = rows[k];
+                        }
+                    } else if (clockwise) {
+                        /* reversed rows put the bottom row in the MSB */
+                        uint8_t in[8];
+                        uint8_t out[8];
+                        for (int k = 0; k < 8; k++) {
+                            in[7 - k] = rows[k];
+                        }
+                        bitmap_transpose8(in, out);
+                        for (int m = 0; m < 8; m++) {
+                            data[(j + m) * (size / 8) + (size - 8 - i) / 8] =
+                                    out[m];
+                        }
+                    } else {
+                        uint8_t out[8];
+                        bitmap_transpose8(rows, out);
+                        for (int m = 0; m < 8; m++) {
+                            data[(size - 1 - j - m) * (size / 8) + i / 8] =
+                                    out[m];
+                        }
+                    }
+                }
+            }
+
+            int x = u;
+            int y = v;
+            int turned_width = w;
+            int turned_height = h;
+            bitmap_orient_map(orient, width, height, &x, &y, &turned_width,
+                    &turned_height);
+            bitmap_blit_clipped(dst, &block, rop, dst_x + x, dst_y + y,
+                    clockwise ? size - h : 0, clockwise ? 0 : size - w, h,
+                    w);
+        }
+    }
+}
+
+
+/* Turns or mirrors a pixel at a time, for what the block loops do not
+ * cover. Custom draw functions see gray sources thresholded at half
+ * coverage, as with bitmap_blit2.
+ */
+static void bitmap_blit_orient_pixels(bitmap_t *dst, const bitmap_t *src,
+        bitmap_draw_fn draw_fn, bitmap_orient_t orient, int dst_x,
+        int dst_y, int src_x, int src_y, int width, int height)
+{
+    bitmap_rop_t rop = BITMAP_ROP_COPY;
+    bool stock = bitmap_draw_rop(draw_fn, &rop);
+    int dst_bpp = bitmap_bpp(dst->format);
+    int src_max = (1 << bitmap_bpp(src->format)) - 1;
+    int dst_max = (1 << dst_bpp) - 1;
+
+    for (int v = 0; v < height; v++) {
+        for (int u = 0; u < width; u++) {
+            int x = u;
+            int y = v;
+            int w = 1;
+            int h = 1;
+            bitmap_orient_map(orient, width, height, &x, &y, &w, &h);
+            uint8_t level = bitmap_level(src, src_x + u, src_y + v);
+            if (!stock) {
+                bitmap_draw(dst, draw_fn, dst_x + x, dst_y + y,
+                        level >= (src_max + 1) / 2);
+                continue;
+            }
+            level = (level * dst_max + src_max / 2) / src_max;
+            uint8_t shift;
+            uint8_t *d = bitmap_addr(dst, dst_x + x, dst_y + y, &shift);
+            *d = bitmap_rop_apply(rop, dst_bpp, *d, level << shift,
+                    dst_max << shift);
+        }
     }
+}
 
-    if (dst_y < 0) {
-        src_y += dst_y;
-        height += dst_y;
-        dst_y = 0;
-    } else if (dst_y > dst->height) {
-        height = dst->height - dst_y;
+
+/* Sets (per rop) a run of pixels starting at x, y inside an image of the
+ * given width placed at dst_x, dst_y, wrapping onto following rows. Only
+ * the part inside clip is drawn.
+ */
+static void bitmap_rle_run(bitmap_t *dst, bitmap_rop_t rop,
+        const bitmap_rect_t *clip, int dst_x, int dst_y, int width, int *x,
+        int *y, int run)
+{
+    while (run > 0) {
+        int n = MIN(run, width - *x);
+        int py = dst_y + *y;
+        if (py >= clip->y && py < clip->y + clip->height) {
+            int x1 = MAX(dst_x + *x, clip->x);
+            int x2 = MIN(dst_x + *x + n, clip->x + clip->width);
+            if (x2 > x1) {
+                bitmap_fill(dst, rop, x1, py, x2 - x1, 1);
+            }
+        }
+        run -= n;
+        *x += n;
+        if (*x == width) {
+            *x = 0;
+            *y += 1;
+        }
     }
+}
 
-    if (width < 0) {
+
+/* Applies rop with an all-ones source to a rectangle, clipped to dst. */
+static void bitmap_fill(bitmap_t *dst, bitmap_rop_t rop, int x, int y,
+        int width, int height)
+{
+    if (!bitmap_clip_rect(dst, &x, &y, &width, &height)) {
         return;
     }
 
-    if (height < 0) {
+    if (dst->format == BITMAP_FORMAT_VLSB) {
+        /* a page at a time, masked to the rows it covers */
+        for (int page = y / 8; page <= (y + height - 1) / 8; page++) {
+            int top = MAX(y - page * 8, 0);
+            int bottom = MIN(y + height - page * 8, 8);
+            uint8_t mask = (0xFF << top) & (0xFF >> (8 - bottom));
+            uint8_t *d = &dst->data[page * dst->width + x];
+            if (mask == 0xFF) {
+                bitmap_fill_bytes(d, rop, width);
+                continue;
+            }
+            for (int i = 0; i < width; i++) {
+                d[i] = bitmap_rop_apply(rop, 1, d[i], 0xFF, mask);
+            }
+        }
         return;
     }
 
-    int src_stride = DIV_ROUND_UP(src->width, 8);
-    int dst_stride = DIV_ROUND_UP(dst->width, 8);
+    /* an all-ones source sets, clears or inverts gray levels bitwise */
+    int bpp = bitmap_bpp(dst->format);
+    int stride = DIV_ROUND_UP(dst->width * bpp, 8);
+    x *= bpp;
+    width *= bpp;
 
-    for (int y = 0; y < height; y++) {
-        src_n = (src_y + y) * src_stride + src_x / 8;
-        src_shift = 7 - (src_x % 8);
-        dst_n = (dst_y + y) * dst_stride + dst_x / 8;
-        dst_shift = 7 - (dst_x % 8);
+    uint8_t *d = &dst->data[y * stride + x / 8];
+    int count = (x + width - 1) / 8 - x / 8 + 1;
+    uint8_t first_mask = 0xFF >> (x & 7);
+    uint8_t last_mask = 0xFF << (7 - ((x + width - 1) & 7));
+    if (count == 1) {
+        first_mask &= last_mask;
+        for (int row = 0; row < height; row++, d += stride) {
+            *d = bitmap_rop_apply(rop, 1, *d, 0xFF, first_mask);
+        }
+        return;
+    }
 
-        for (int x = 0; x < width; x++) {
-            uint8_t bit = (src->data[src_n] >> src_shift) & 1;
-            draw_fn(&dst->data[dst_n], dst_shift, bit);
-            if (src_shift-- == 0) {
-                src_shift = 7;
-                src_n++;
-            }
-            if (dst_shift-- == 0) {
-                dst_shift = 7;
-                dst_n++;
+    for (int row = 0; row < height; row++, d += stride) {
+        d[0] = bitmap_rop_apply(rop, 1, d[0], 0xFF, first_mask);
+        bitmap_fill_bytes(d + 1, rop, count - 2);
+        d[count - 1] = bitmap_rop_apply(rop, 1, d[count - 1], 0xFF,
+                last_mask);
+    }
+}
+
+
+static void bitmap_fill_bytes(uint8_t *d, bitmap_rop_t rop, int count)
+{
+    if (rop == BITMAP_ROP_XOR) {
+        for (int i = 0; i < count; i++) {
+            d[i] ^= 0xFF;
+        }
+    } else {
+        memset(d, rop == BITMAP_ROP_ANDNOT ? 0x00 : 0xFF, count);
+    }
+}
+
+
+static void bitmap_blit_rle_pixels(bitmap_t *dst, const uint8_t *rle,
+        int width, int height, bitmap_draw_fn draw_fn,
+        const bitmap_rect_t *clip, int dst_x, int dst_y)
+{
+    int x = 0;
+    int y = 0;
+    for (; y < height; rle++) {
+        int zeros = *rle ? *rle >> 4 : width * height;
+        int ones = *rle & 0x0F;
+        for (int i = 0; i < zeros + ones && y < height; i++) {
+            int px = dst_x + x;
+            int py = dst_y + y;
+            if (px >= clip->x && px < clip->x + clip->width &&
+                    py >= clip->y && py < clip->y + clip->height) {
+                bitmap_draw(dst, draw_fn, px, py, i >= zeros);
+            }
+            if (++x == width) {
+                x = 0;
+                y++;
             }
         }
     }
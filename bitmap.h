@@ -1,16 +1,78 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
+#define BITMAP_DAMAGE_RECTS 8
+
+typedef struct bitmap_rect_t {
+    int16_t x;
+    int16_t y;
+    int16_t width;
+    int16_t height;
+} bitmap_rect_t;
+
+typedef struct bitmap_damage_t {
+    uint8_t count;
+    bitmap_rect_t rects[BITMAP_DAMAGE_RECTS];
+} bitmap_damage_t;
+
+typedef enum bitmap_format_t {
+    BITMAP_FORMAT_HMSB, /* rows of bytes, MSB is the leftmost pixel */
+    BITMAP_FORMAT_VLSB, /* pages of 8 rows, a byte per column, LSB on top */
+    BITMAP_FORMAT_GRAY2, /* rows of 2 bit levels, leftmost in the MSBs */
+    BITMAP_FORMAT_GRAY4, /* rows of 4 bit levels, leftmost in the MSBs */
+} bitmap_format_t;
+
 typedef struct bitmap_t {
     uint16_t width;
     uint16_t height;
-    uint8_t data[];
+    uint8_t format;
+    bitmap_damage_t *damage;
+    uint8_t *data;
 } bitmap_t;
 
+typedef enum bitmap_rop_t {
+    BITMAP_ROP_COPY,
+    BITMAP_ROP_OR,
+    BITMAP_ROP_ANDNOT,
+    BITMAP_ROP_XOR,
+} bitmap_rop_t;
+
+typedef enum bitmap_orient_t {
+    BITMAP_ORIENT_NONE,
+    BITMAP_ORIENT_ROTATE_90, /* turned a quarter clockwise */
+    BITMAP_ORIENT_ROTATE_180,
+    BITMAP_ORIENT_ROTATE_270,
+    BITMAP_ORIENT_FLIP_X, /* mirrored left to right */
+    BITMAP_ORIENT_FLIP_Y, /* mirrored top to bottom */
+} bitmap_orient_t;
+
 typedef void (*bitmap_draw_fn)(uint8_t *byte, uint8_t shift, uint8_t bit);
 
+/* bitmap_data_size as a constant expression, for sizing storage */
+#define BITMAP_DATA_SIZE(width, height, format) \
+    ((format) == BITMAP_FORMAT_VLSB ? (width) * (((height) + 7) / 8) : \
+    ((width) * ((format) == BITMAP_FORMAT_GRAY4 ? 4 : \
+    (format) == BITMAP_FORMAT_GRAY2 ? 2 : 1) + 7) / 8 * (height))
+
+/* Defines name as a cleared bitmap with static storage, at file or block
+ * scope. */
+#define BITMAP_STATIC(name, w, h, fmt) \
+    static uint8_t name##_data[BITMAP_DATA_SIZE(w, h, fmt)]; \
+    static bitmap_t name = { \
+        .width = (w), \
+        .height = (h), \
+        .format = (fmt), \
+        .data = name##_data, \
+    }
+
 bitmap_t *bitmap_new(int width, int height);
+bitmap_t *bitmap_new_format(int width, int height, bitmap_format_t format);
+void bitmap_init(bitmap_t *bitmap, int width, int height,
+        bitmap_format_t format, uint8_t *data);
+size_t bitmap_data_size(int width, int height, bitmap_format_t format);
+int bitmap_bpp(bitmap_format_t format);
 void bitmap_free(bitmap_t *image);
 void bitmap_set_pixel(uint8_t *byte, uint8_t shift, uint8_t bit);
 void bitmap_clear_pixel(uint8_t *byte, uint8_t shift, uint8_t bit);
@@ -19,7 +81,29 @@ void bitmap_plot(bitmap_t *bitmap, bitmap_draw_fn draw_fn, int x, int y);
 void bitmap_line(bitmap_t *bitmap, bitmap_draw_fn draw_fn, int x1, int y1,
         int x2, int y2);
 void bitmap_invert(bitmap_t *bitmap);
+void bitmap_hline(bitmap_t *bitmap, bitmap_draw_fn draw_fn, int x, int y,
+        int width);
+void bitmap_vline(bitmap_t *bitmap, bitmap_draw_fn draw_fn, int x, int y,
+        int height);
+void bitmap_fill_rect(bitmap_t *bitmap, bitmap_draw_fn draw_fn, int x, int y,
+        int width, int height);
+void bitmap_invert_rect(bitmap_t *bitmap, int x, int y, int width,
+        int height);
 void bitmap_blit(bitmap_t *dst, const bitmap_t *src, int dst_x, int dst_y,
         int src_x, int src_y, int width, int height);
 void bitmap_blit2(bitmap_t *dst, const bitmap_t *src, bitmap_draw_fn draw_fn,
-        int dst_x, int dst_y, int src_x, int src_y, int width, int height);
\ No newline at end of file
+        int dst_x, int dst_y, int src_x, int src_y, int width, int height);
+void bitmap_blit_rop(bitmap_t *dst, const bitmap_t *src, bitmap_rop_t rop,
+        int dst_x, int dst_y, int src_x, int src_y, int width, int height);
+void bitmap_blit_orient(bitmap_t *dst, const bitmap_t *src,
+        bitmap_draw_fn draw_fn, bitmap_orient_t orient, int dst_x, int dst_y,
+        int src_x, int src_y, int width, int height);
+void bitmap_orient_rect(const bitmap_t *bitmap, bitmap_orient_t orient,
+        int *x, int *y, int *width, int *height);
+void bitmap_blit_rle(bitmap_t *dst, const uint8_t *rle, int width, int height,
+        bitmap_draw_fn draw_fn, int dst_x, int dst_y);
+void bitmap_blit_rle_clip(bitmap_t *dst, const uint8_t *rle, int width,
+        int height, bitmap_draw_fn draw_fn, int dst_x, int dst_y,
+        const bitmap_rect_t *clip);
+void bitmap_damage_add(bitmap_t *bitmap, int x, int y, int width, int height);
+void bitmap_damage_clear(bitmap_damage_t *damage);
@@ -0,0 +1,183 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "bitmap_pool.h"
+#include "util.h"
+
+
+/* The bitmap header of a block, followed by its data. next links the free
+ * blocks of a class.
+ */
+typedef struct bitmap_pool_block_t {
+    bitmap_t bitmap;
+    struct bitmap_pool_block_t *next;
+} bitmap_pool_block_t;
+
+/* The blocks of a class lie stride bytes apart from start to end. */
+typedef struct bitmap_pool_list_t {
+    bitmap_pool_stats_t stats;
+    uint8_t *start;
+    uint8_t *end;
+    size_t stride;
+    bitmap_pool_block_t *free;
+} bitmap_pool_list_t;
+
+/* Size classes in increasing order, with all blocks in one allocation made
+ * up front, so that bitmaps come and go without touching the heap.
+ */
+struct bitmap_pool_t {
+    int class_count;
+    bitmap_pool_list_t lists[];
+};
+
+static size_t bitmap_pool_align(size_t size);
+
+
+/* Creates a pool with the given size classes, which must be in increasing
+ * order of size.
+ */
+bitmap_pool_t *bitmap_pool_new(const bitmap_pool_class_t *classes,
+        int class_count)
+{
+    size_t header = bitmap_pool_align(sizeof(bitmap_pool_t) +
+            class_count * sizeof(bitmap_pool_list_t));
+    size_t bytes = header;
+    for (int i = 0; i < class_count; i++) {
+        assert(i == 0 || classes[i].size > classes[i - 1].size);
+        bytes += classes[i].count * (sizeof(bitmap_pool_block_t) +
+                bitmap_pool_align(classes[i].size));
+    }
+
+    bitmap_pool_t *pool = calloc(1, bytes);
+    assert(pool != NULL);
+    pool->class_count = class_count;
+
+    uint8_t *block = (uint8_t *)pool + header;
+    for (int i = 0; i < class_count; i++) {
+        bitmap_pool_list_t *list = &pool->lists[i];
+        list->stats.size = classes[i].size;
+        list->stats.count = classes[i].count;
+        list->stride = sizeof(bitmap_pool_block_t) +
+                bitmap_pool_align(classes[i].size);
+        list->start = block;
+        block += classes[i].count * list->stride;
+        list->end = block;
+
+        /* threaded from the end, so blocks are handed out in address
+         * order */
+        for (uint8_t *p = list->end; p > list->start;) {
+            p -= list->stride;
+            bitmap_pool_block_t *b = (bitmap_pool_block_t *)p;
+            b->next = list->free;
+            list->free = b;
+        }
+    }
+    return pool;
+}
+
+
+/* Frees the pool and with it every bitmap still taken from it. */
+void bitmap_pool_free(bitmap_pool_t *pool)
+{
+    free(pool);
+}
+
+
+/* Takes a cleared bitmap from the smallest class that has a free block large
+ * enough. Returns NULL when there is none.
+ */
+bitmap_t *bitmap_pool_get(bitmap_pool_t *pool, int width, int height,
+        bitmap_format_t format)
+{
+    size_t size = bitmap_data_size(width, height, format);
+    bitmap_pool_list_t *fit = NULL;
+    for (int i = 0; i < pool->class_count; i++) {
+        bitmap_pool_list_t *list = &pool->lists[i];
+        if (list->stats.size < size) {
+            continue;
+        }
+        fit = fit ? fit : list;
+        if (list->free == NULL) {
+            continue;
+        }
+
+        if (list != fit) {
+            fit->stats.spills++;
+        }
+        bitmap_pool_block_t *block = list->free;
+        list->free = block->next;
+        list->stats.used++;
+        list->stats.high_water = MAX(list->stats.high_water,
+                list->stats.used);
+        bitmap_init(&block->bitmap, width, height, format,
+                (uint8_t *)(block + 1));
+        return &block->bitmap;
+    }
+
+    /* requests larger than every class count against the largest */
+    if (fit == NULL && pool->class_count) {
+        fit = &pool->lists[pool->class_count - 1];
+    }
+    if (fit) {
+        fit->stats.failures++;
+    }
+    return NULL;
+}
+
+
+/* Returns a bitmap taken from the pool. NULL is ignored. */
+void bitmap_pool_put(bitmap_pool_t *pool, bitmap_t *bitmap)
+{
+    if (bitmap == NULL) {
+        return;
+    }
+    uint8_t *p = (uint8_t *)bitmap;
+    for (int i = 0; i < pool->class_count; i++) {
+        bitmap_pool_list_t *list = &pool->lists[i];
+        if (p >= list->start && p < list->end) {
+            assert((p - list->start) % list->stride == 0);
+            bitmap_pool_block_t *block = (bitmap_pool_block_t *)p;
+            block->next = list->free;
+            list->free = block;
+            list->stats.used--;
+            return;
+        }
+    }
+    assert(!"bitmap not from this pool");
+}
+
+
+int bitmap_pool_class_count(const bitmap_pool_t *pool)
+{
+    return pool->class_count;
+}
+
+
+void bitmap_pool_get_stats(const bitmap_pool_t *pool, int index,
+        bitmap_pool_stats_t *stats)
+{
+    *stats = pool->lists[index].stats;
+}
+
+
+/* Clears the counters and brings the high water marks down to the blocks
+ * in use now.
+ */
+void bitmap_pool_reset_stats(bitmap_pool_t *pool)
+{
+    for (int i = 0; i < pool->class_count; i++) {
+        bitmap_pool_stats_t *stats = &pool->lists[i].stats;
+        stats->high_water = stats->used;
+        stats->spills = 0;
+        stats->failures = 0;
+    }
+}
+
+
+/* Rounds size up so that a block header placed after it is aligned. */
+static size_t bitmap_pool_align(size_t size)
+{
+    size_t align = _Alignof(bitmap_pool_block_t);
+    return DIV_ROUND_UP(size, align) * align;
+}
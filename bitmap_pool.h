@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bitmap.h"
+
+typedef struct bitmap_pool_t bitmap_pool_t;
+
+/* count blocks that each hold up to size bytes of bitmap data */
+typedef struct bitmap_pool_class_t {
+    size_t size;
+    uint16_t count;
+} bitmap_pool_class_t;
+
+typedef struct bitmap_pool_stats_t {
+    size_t size;
+    uint16_t count;
+    uint16_t used;
+    uint16_t high_water;
+    uint32_t spills; /* served by a larger class as this one was full */
+    uint32_t failures; /* not served at all */
+} bitmap_pool_stats_t;
+
+
+bitmap_pool_t *bitmap_pool_new(const bitmap_pool_class_t *classes,
+        int class_count);
+void bitmap_pool_free(bitmap_pool_t *pool);
+bitmap_t *bitmap_pool_get(bitmap_pool_t *pool, int width, int height,
+        bitmap_format_t format);
+void bitmap_pool_put(bitmap_pool_t *pool, bitmap_t *bitmap);
+int bitmap_pool_class_count(const bitmap_pool_t *pool);
+void bitmap_pool_get_stats(const bitmap_pool_t *pool, int index,
+        bitmap_pool_stats_t *stats);
+void bitmap_pool_reset_stats(bitmap_pool_t *pool);
@@ -0,0 +1,341 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "console.h"
+#include "text.h"
+#include "unicode.h"
+#include "util.h"
+
+#define CONSOLE_TAB 8
+
+
+/* A grid of character cells drawn into a fixed area of dst. Cells that
+ * changed since the last flush are marked dirty, and scroll counts the rows
+ * the cells moved up by, which the pixels follow at the next flush.
+ */
+struct console_t {
+    bitmap_t *dst;
+    const void *font;
+    int xpos;
+    int ypos;
+    int cell_width;
+    int cell_height;
+    int columns;
+    int rows;
+    int column;
+    int row;
+    int scroll;
+    uint32_t *cells;
+    bool *dirty;
+};
+
+static void console_newline(console_t *console);
+static void console_scroll(console_t *console, int rows);
+static bool console_move(console_t *console, int dy);
+static void console_draw_cell(console_t *console, int index,
+        text_config_t *config);
+
+
+/* Creates a console covering as many cells of the monospace font as fit in
+ * width by height pixels of dst at xpos, ypos. The console owns that area,
+ * and the first flush clears and draws all of it. Returns NULL if the font
+ * is not monospace or not a single cell fits.
+ */
+console_t *console_new(bitmap_t *dst, const void *font, int xpos, int ypos,
+        int width, int height)
+{
+    int cell_width;
+    int cell_height;
+    if (!text_monospace_cell(font, &cell_width, &cell_height)) {
+        return NULL;
+    }
+    width = MIN(width, (int)dst->width - xpos);
+    height = MIN(height, (int)dst->height - ypos);
+    if (xpos < 0 || ypos < 0 || width < cell_width ||
+            height < cell_height) {
+        return NULL;
+    }
+
+    console_t *console = calloc(1, sizeof(console_t));
+    assert(console != NULL);
+    console->dst = dst;
+    console->font = font;
+    console->xpos = xpos;
+    console->ypos = ypos;
+    console->cell_width = cell_width;
+    console->cell_height = cell_height;
+    console->columns = width / cell_width;
+    console->rows = height / cell_height;
+
+    int count = console->columns * console->rows;
+    console->cells = malloc(count * sizeof(uint32_t));
+    console->dirty = malloc(count * sizeof(bool));
+    assert(console->cells != NULL && console->dirty != NULL);
+    for (int i = 0; i < count; i++) {
+        console->cells[i] = ' ';
+        console->dirty[i] = true;
+    }
+    return console;
+}
+
+
+void console_free(console_t *console)
+{
+    if (console == NULL) {
+        return;
+    }
+    free(console->cells);
+    free(console->dirty);
+    free(console);
+}
+
+
+int console_columns(const console_t *console)
+{
+    return console->columns;
+}
+
+
+int console_rows(const console_t *console)
+{
+    return console->rows;
+}
+
+
+/* Blanks every cell and moves the cursor home.
+ */
+void console_clear(console_t *console)
+{
+    for (int row = 0; row < console->rows; row++) {
+        for (int column = 0; column < console->columns; column++) {
+            console_put(console, column, row, ' ');
+        }
+    }
+    console->column = 0;
+    console->row = 0;
+}
+
+
+void console_move_to(console_t *console, int column, int row)
+{
+    console->column = MAX(0, MIN(column, console->columns - 1));
+    console->row = MAX(0, MIN(row, console->rows - 1));
+}
+
+
+/* Sets a cell, marking it dirty only if it changes.
+ */
+void console_put(console_t *console, int column, int row, uint32_t cp)
+{
+    if (column < 0 || column >= console->columns || row < 0 ||
+            row >= console->rows) {
+        return;
+    }
+    int index = row * console->columns + column;
+    if (console->cells[index] != cp) {
+        console->cells[index] = cp;
+        console->dirty[index] = true;
+    }
+}
+
+
+/* Writes UTF-8 text at the cursor, wrapping at the right edge and scrolling
+ * up at the bottom. \n starts a new line, \r returns to the first column,
+ * \t advances to the next tab stop and \b moves back a column. Other
+ * control characters are ignored. Nothing is drawn until console_flush.
+ */
+void console_write(console_t *console, const char *s)
+{
+    while (*s) {
+        uint32_t cp;
+        s += utf8_cp(s, &cp);
+        if (cp == '\n') {
+            console_newline(console);
+        } else if (cp == '\r') {
+            console->column = 0;
+        } else if (cp == '\t') {
+            int column = (console->column / CONSOLE_TAB + 1) * CONSOLE_TAB;
+            console->column = MIN(column, console->columns);
+        } else if (cp == '\b') {
+            console->column = MAX(console->column - 1, 0);
+        } else if (cp >= 0x20 && cp != 0x7F) {
+            /* the cursor stays past the last column until there is
+             * something to wrap */
+            if (console->column >= console->columns) {
+                console_newline(console);
+            }
+            console_put(console, console->column, console->row, cp);
+            console->column++;
+        }
+    }
+}
+
+
+/* Redraws every cell at the next flush, for when dst was drawn over.
+ */
+void console_invalidate(console_t *console)
+{
+    memset(console->dirty, true, console->columns * console->rows *
+            sizeof(bool));
+    console->scroll = 0;
+}
+
+
+/* Draws the dirty cells into dst. Rows scrolled since the last flush are
+ * moved as a block of dst data, so only the new rows are drawn, except for
+ * VLSB when the console is not aligned to pages, in which case every cell
+ * is drawn.
+ */
+void console_flush(console_t *console)
+{
+    if (console->scroll) {
+        if (console->scroll >= console->rows ||
+                !console_move(console, console->scroll *
+                console->cell_height)) {
+            console_invalidate(console);
+        }
+        console->scroll = 0;
+    }
+
+    text_config_t config = {
+        .draw_fn = bitmap_set_pixel,
+        .overflow = TEXT_OVERFLOW_BREAK_WORD,
+    };
+    int count = console->columns * console->rows;
+    for (int i = 0; i < count; i++) {
+        if (console->dirty[i]) {
+            console_draw_cell(console, i, &config);
+            console->dirty[i] = false;
+        }
+    }
+}
+
+
+static void console_newline(console_t *console)
+{
+    console->column = 0;
+    if (console->row + 1 < console->rows) {
+        console->row++;
+    } else {
+        console_scroll(console, 1);
+    }
+}
+
+
+/* Moves the cells up, leaving blank dirty rows at the bottom. The dirty
+ * flags move along, as the pixels are moved the same way at the next
+ * flush.
+ */
+static void console_scroll(console_t *console, int rows)
+{
+    int columns = console->columns;
+    rows = MIN(rows, console->rows);
+    int kept = (console->rows - rows) * columns;
+    memmove(console->cells, console->cells + rows * columns,
+            kept * sizeof(uint32_t));
+    memmove(console->dirty, console->dirty + rows * columns,
+            kept * sizeof(bool));
+    for (int i = kept; i < console->rows * columns; i++) {
+        console->cells[i] = ' ';
+        console->dirty[i] = true;
+    }
+    console->scroll = MIN(console->scroll + rows, console->rows);
+}
+
+
+/* Moves the pixels of the console up by dy rows. Where the console spans
+ * whole lines of dst this is a single memmove, otherwise one per line, with
+ * the bytes it shares at its left and right edges merged. Returns false for
+ * VLSB when the console or dy is not aligned to pages.
+ */
+static bool console_move(console_t *console, int dy)
+{
+    bitmap_t *dst = console->dst;
+    int x = console->xpos;
+    int y = console->ypos;
+    int width = console->columns * console->cell_width;
+    int height = console->rows * console->cell_height;
+
+    size_t line_size;
+    size_t offset;
+    size_t size;
+    uint8_t head = 0xFF;
+    uint8_t tail = 0xFF;
+    int first;
+    int lines;
+    int shift;
+    if (dst->format == BITMAP_FORMAT_VLSB) {
+        if (y % 8 || dy % 8 || (height % 8 && y + height != dst->height)) {
+            return false;
+        }
+        line_size = dst->width;
+        offset = x;
+        size = width;
+        first = y / 8;
+        lines = DIV_ROUND_UP(height, 8);
+        shift = dy / 8;
+    } else {
+        int bpp = bitmap_bpp(dst->format);
+        int left = x * bpp;
+        int right = (x + width) * bpp;
+        line_size = bitmap_data_size(dst->width, 1, dst->format);
+        offset = left / 8;
+        size = DIV_ROUND_UP(right, 8) - offset;
+        head = 0xFF >> left % 8;
+        if (right % 8 && x + width != dst->width) {
+            tail = 0xFF << (8 - right % 8);
+        }
+        if (size == 1) {
+            head &= tail;
+            tail = head;
+        }
+        first = y;
+        lines = height;
+        shift = dy;
+    }
+
+    uint8_t *data = dst->data + first * line_size;
+    if (offset == 0 && size == line_size && head == 0xFF && tail == 0xFF) {
+        memmove(data, data + shift * line_size,
+                (lines - shift) * line_size);
+    } else {
+        for (int i = 0; i < lines - shift; i++) {
+            uint8_t *to = data + i * line_size + offset;
+            const uint8_t *from = to + shift * line_size;
+            uint8_t first_byte = (to[0] & ~head) | (from[0] & head);
+            uint8_t last_byte = (to[size - 1] & ~tail) |
+                    (from[size - 1] & tail);
+            memcpy(to, from, size);
+            to[0] = first_byte;
+            to[size - 1] = last_byte;
+        }
+    }
+    bitmap_damage_add(dst, x, y, width, height - dy);
+    return true;
+}
+
+
+/* Clears the cell and draws its glyph clipped to it, so that a cell looks
+ * the same whether or not its neighbours are drawn too.
+ */
+static void console_draw_cell(console_t *console, int index,
+        text_config_t *config)
+{
+    int x = console->xpos + index % console->columns * console->cell_width;
+    int y = console->ypos + index / console->columns * console->cell_height;
+    bitmap_fill_rect(console->dst, bitmap_clear_pixel, x, y,
+            console->cell_width, console->cell_height);
+
+    uint32_t cp = console->cells[index];
+    if (cp == ' ') {
+        return;
+    }
+    char s[5];
+    s[utf8_encode_cp(cp, s)] = '\0';
+    config->clip = (bitmap_rect_t) { x, y, console->cell_width,
+            console->cell_height };
+    text_render(console->dst, config, console->font, x, y,
+            console->cell_width + 1, console->cell_height, s);
+}
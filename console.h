@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bitmap.h"
+
+typedef struct console_t console_t;
+
+
+console_t *console_new(bitmap_t *dst, const void *font, int xpos, int ypos,
+        int width, int height);
+void console_free(console_t *console);
+int console_columns(const console_t *console);
+int console_rows(const console_t *console);
+void console_clear(console_t *console);
+void console_move_to(console_t *console, int column, int row);
+void console_put(console_t *console, int column, int row, uint32_t cp);
+void console_write(console_t *console, const char *s);
+void console_invalidate(console_t *console);
+void console_flush(console_t *console);
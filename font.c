@@ -0,0 +1,416 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "font.h"
+#include "font_format.h"
+#include "text.h"
+#include "util.h"
+
+#define FONT_SLOT_NONE 0xFFFF
+#define FONT_SLOT_EMPTY UINT32_MAX
+
+
+typedef struct font_slot_t {
+    uint32_t cp;
+    uint16_t prev;
+    uint16_t next;
+    uint16_t chain;
+    bool rle;
+    size_t capacity;
+    font_glyph_t *glyph;
+} font_slot_t;
+
+/* The header, group directory and latin table are kept in memory with the
+ * same layout as a font blob, so lookups are shared with in-memory fonts.
+ * Glyph records are read on demand into a fixed number of slots, which are
+ * kept in most recently used order and indexed by code point.
+ */
+struct font_stream_t {
+    uint32_t magic;
+    font_read_fn read_fn;
+    void *arg;
+    font_stream_stats_t stats;
+    uint16_t slot_count;
+    uint16_t head;
+    uint16_t tail;
+    uint16_t bucket_mask;
+    uint16_t *buckets;
+    font_slot_t *slots;
+    uint8_t header[];
+};
+
+static void font_slot_unlink(font_stream_t *stream, uint16_t i);
+static void font_slot_push(font_stream_t *stream, uint16_t i);
+static void font_slot_unhash(font_stream_t *stream, uint16_t i);
+static size_t font_prefix_size(const font_header_t *header,
+        const font_kerning_t *kerning);
+
+
+const font_group_t *font_find_group(const void *font, uint32_t cp)
+{
+    const font_header_t *header = font;
+    const font_group_t *groups = (const font_group_t *)((const uint8_t *)font +
+            sizeof(font_header_t));
+
+    if (cp < FONT_LATIN_COUNT) {
+        const uint8_t *latin = (const uint8_t *)&groups[header->group_count];
+        return latin[cp] ? &groups[latin[cp] - 1] : NULL;
+    }
+
+    int lo = 0;
+    int hi = header->group_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cp < groups[mid].first) {
+            hi = mid - 1;
+        } else if (cp > groups[mid].last) {
+            lo = mid + 1;
+        } else {
+            return &groups[mid];
+        }
+    }
+    return NULL;
+}
+
+
+const font_kerning_t *font_get_kerning(const void *font)
+{
+    const font_header_t *header = font;
+    if (!(header->flags & FONT_FLAG_KERNING)) {
+        return NULL;
+    }
+    return (const font_kerning_t *)((const uint8_t *)font +
+            font_prefix_size(header, NULL));
+}
+
+
+/* Bits per pixel of the glyph bitmaps.
+ */
+int font_bpp(const void *font)
+{
+    const font_header_t *header = font;
+    if (header->flags & FONT_FLAG_GRAY4) {
+        return 4;
+    } else if (header->flags & FONT_FLAG_GRAY2) {
+        return 2;
+    }
+    return 1;
+}
+
+
+/* Finds the pairs that have left as their left glyph. range->count is 0 if
+ * there are none.
+ */
+void font_kern_range(const font_kerning_t *kerning, uint32_t left,
+        font_kern_range_t *range)
+{
+    const font_kern_left_t *lefts = (const font_kern_left_t *)(kerning + 1);
+    const font_kern_pair_t *pairs = (const font_kern_pair_t *)(lefts +
+            kerning->left_count);
+
+    int lo = 0;
+    int hi = kerning->left_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (left < lefts[mid].cp) {
+            hi = mid - 1;
+        } else if (left > lefts[mid].cp) {
+            lo = mid + 1;
+        } else {
+            range->pairs = &pairs[lefts[mid].first];
+            range->count = lefts[mid].count;
+            return;
+        }
+    }
+    range->pairs = NULL;
+    range->count = 0;
+}
+
+
+int font_kern_value(const font_kern_range_t *range, uint32_t right)
+{
+    int lo = 0;
+    int hi = range->count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (right < range->pairs[mid].cp) {
+            hi = mid - 1;
+        } else if (right > range->pairs[mid].cp) {
+            lo = mid + 1;
+        } else {
+            return range->pairs[mid].value;
+        }
+    }
+    return 0;
+}
+
+
+const font_table_glyph_t *font_table_glyph(const font_table_t *table,
+        uint32_t cp)
+{
+    if (cp < 128) {
+        return table->ascii[cp];
+    }
+
+    int lo = 0;
+    int hi = table->range_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        const font_table_range_t *range = &table->ranges[mid];
+        if (cp < range->first) {
+            hi = mid - 1;
+        } else if (cp > range->last) {
+            lo = mid + 1;
+        } else {
+            const font_table_glyph_t *glyph = &range->glyphs[cp -
+                    range->first];
+            return glyph->data ? glyph : NULL;
+        }
+    }
+    return NULL;
+}
+
+
+/* Opens a font through read_fn, which may be backed by a file, a flash
+ * partition or anything else addressable by offset. Returns NULL if the
+ * font can not be read or is not a supported version. The stream can be
+ * passed anywhere a font blob is accepted.
+ */
+font_stream_t *font_stream_open(font_read_fn read_fn, void *arg,
+        int cache_slots)
+{
+    font_header_t header;
+    if (read_fn(arg, 0, &header, sizeof(header)) != sizeof(header) ||
+            header.magic != FONT_MAGIC || header.version != FONT_VERSION) {
+        return NULL;
+    }
+
+    font_kerning_t kerning;
+    size_t size = font_prefix_size(&header, NULL);
+    if (header.flags & FONT_FLAG_KERNING) {
+        if (read_fn(arg, size, &kerning, sizeof(kerning)) !=
+                sizeof(kerning)) {
+            return NULL;
+        }
+        size = font_prefix_size(&header, &kerning);
+    }
+
+    font_stream_t *stream = calloc(1, sizeof(font_stream_t) + size);
+    assert(stream != NULL);
+    if (read_fn(arg, 0, stream->header, size) != size) {
+        free(stream);
+        return NULL;
+    }
+
+    stream->magic = FONT_STREAM_MAGIC;
+    stream->read_fn = read_fn;
+    stream->arg = arg;
+    stream->slot_count = MIN(MAX(cache_slots, 1), FONT_SLOT_NONE - 1);
+
+    int bucket_count = 1;
+    while (bucket_count < stream->slot_count) {
+        bucket_count <<= 1;
+    }
+    stream->bucket_mask = bucket_count - 1;
+    stream->buckets = malloc(bucket_count * sizeof(uint16_t));
+    assert(stream->buckets != NULL);
+    memset(stream->buckets, 0xFF, bucket_count * sizeof(uint16_t));
+
+    stream->slots = calloc(stream->slot_count, sizeof(font_slot_t));
+    assert(stream->slots != NULL);
+    stream->head = FONT_SLOT_NONE;
+    stream->tail = FONT_SLOT_NONE;
+    for (uint16_t i = 0; i < stream->slot_count; i++) {
+        stream->slots[i].cp = FONT_SLOT_EMPTY;
+        font_slot_push(stream, i);
+    }
+
+    return stream;
+}
+
+
+void font_stream_free(font_stream_t *stream)
+{
+    if (stream == NULL) {
+        return;
+    }
+    for (uint16_t i = 0; i < stream->slot_count; i++) {
+        free(stream->slots[i].glyph);
+    }
+    free(stream->slots);
+    free(stream->buckets);
+    free(stream);
+}
+
+
+void font_stream_get_stats(const font_stream_t *stream,
+        font_stream_stats_t *stats)
+{
+    *stats = stream->stats;
+}
+
+
+void font_stream_reset_stats(font_stream_t *stream)
+{
+    memset(&stream->stats, 0, sizeof(stream->stats));
+}
+
+
+/* A font_read_fn for a FILE * opened in binary mode.
+ */
+size_t font_stream_read_file(void *arg, uint32_t offset, void *buf,
+        size_t size)
+{
+    FILE *f = arg;
+    if (fseek(f, offset, SEEK_SET) != 0) {
+        return 0;
+    }
+    return fread(buf, 1, size, f);
+}
+
+
+const void *font_stream_header(const font_stream_t *stream)
+{
+    return stream->header;
+}
+
+
+/* Returns the glyph record for cp, reading it into the least recently used
+ * slot on a miss. The record stays valid until the next call. Only glyphs
+ * loaded into a slot count as misses, not code points the font lacks,
+ * including gaps within a group.
+ */
+const font_glyph_t *font_stream_glyph(font_stream_t *stream, uint32_t cp,
+        bool *rle)
+{
+    uint16_t *bucket = &stream->buckets[cp & stream->bucket_mask];
+    for (uint16_t i = *bucket; i != FONT_SLOT_NONE;
+            i = stream->slots[i].chain) {
+        font_slot_t *slot = &stream->slots[i];
+        if (slot->cp == cp) {
+            stream->stats.hits++;
+            font_slot_unlink(stream, i);
+            font_slot_push(stream, i);
+            *rle = slot->rle;
+            return slot->glyph;
+        }
+    }
+
+    const font_group_t *group = font_find_group(stream->header, cp);
+    if (group == NULL) {
+        return NULL;
+    }
+
+    uint32_t offset;
+    font_glyph_t glyph;
+    if (stream->read_fn(stream->arg, group->offsets + (cp - group->first) *
+            sizeof(offset), &offset, sizeof(offset)) != sizeof(offset) ||
+            offset == 0) {
+        return NULL;
+    }
+    if (stream->read_fn(stream->arg, offset & ~FONT_OFFSET_RLE, &glyph,
+            sizeof(glyph)) != sizeof(glyph)) {
+        return NULL;
+    }
+
+    /* run-length data is only stored when smaller than the bitmap, so the
+     * bitmap size bounds both, a short read is fine for the last glyph */
+    size_t size = DIV_ROUND_UP(glyph.width * font_bpp(stream->header), 8) *
+            glyph.height;
+
+    uint16_t i = stream->tail;
+    font_slot_t *slot = &stream->slots[i];
+    font_slot_unlink(stream, i);
+    font_slot_unhash(stream, i);
+    slot->cp = FONT_SLOT_EMPTY;
+    if (slot->capacity < sizeof(glyph) + size) {
+        slot->capacity = sizeof(glyph) + size;
+        slot->glyph = realloc(slot->glyph, slot->capacity);
+        assert(slot->glyph != NULL);
+    }
+
+    size_t n = size ? stream->read_fn(stream->arg, (offset &
+            ~FONT_OFFSET_RLE) + sizeof(glyph), slot->glyph->data, size) : 0;
+    if (n < size && (!(offset & FONT_OFFSET_RLE) || n == 0)) {
+        font_slot_push(stream, i);
+        return NULL;
+    }
+
+    stream->stats.misses++;
+    memcpy(slot->glyph, &glyph, sizeof(glyph));
+    slot->cp = cp;
+    slot->rle = offset & FONT_OFFSET_RLE;
+    slot->chain = *bucket;
+    *bucket = i;
+    font_slot_push(stream, i);
+    *rle = slot->rle;
+    return slot->glyph;
+}
+
+
+static void font_slot_unlink(font_stream_t *stream, uint16_t i)
+{
+    font_slot_t *slot = &stream->slots[i];
+    if (slot->prev != FONT_SLOT_NONE) {
+        stream->slots[slot->prev].next = slot->next;
+    } else {
+        stream->head = slot->next;
+    }
+    if (slot->next != FONT_SLOT_NONE) {
+        stream->slots[slot->next].prev = slot->prev;
+    } else {
+        stream->tail = slot->prev;
+    }
+}
+
+
+/* Makes slot i the most recently used.
+ */
+static void font_slot_push(font_stream_t *stream, uint16_t i)
+{
+    font_slot_t *slot = &stream->slots[i];
+    slot->prev = FONT_SLOT_NONE;
+    slot->next = stream->head;
+    if (stream->head != FONT_SLOT_NONE) {
+        stream->slots[stream->head].prev = i;
+    } else {
+        stream->tail = i;
+    }
+    stream->head = i;
+}
+
+
+static void font_slot_unhash(font_stream_t *stream, uint16_t i)
+{
+    font_slot_t *slot = &stream->slots[i];
+    if (slot->cp == FONT_SLOT_EMPTY) {
+        return;
+    }
+
+    uint16_t *link = &stream->buckets[slot->cp & stream->bucket_mask];
+    while (*link != i) {
+        link = &stream->slots[*link].chain;
+    }
+    *link = slot->chain;
+}
+
+
+/* Size of the header, group directory and latin table, plus the kerning
+ * table if one is given.
+ */
+static size_t font_prefix_size(const font_header_t *header,
+        const font_kerning_t *kerning)
+{
+    size_t size = sizeof(font_header_t) + header->group_count *
+            sizeof(font_group_t) + FONT_LATIN_COUNT;
+    if (kerning) {
+        size += sizeof(font_kerning_t) + kerning->left_count *
+                sizeof(font_kern_left_t) + kerning->pair_count *
+                sizeof(font_kern_pair_t);
+        size = (size + 3) & ~3;
+    }
+    return size;
+}
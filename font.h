@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FONT_TABLE_MAGIC 0x6c626174
+
+
+/* Reads size bytes at offset of the font image into buf, returning the
+ * number of bytes read.
+ */
+typedef size_t (*font_read_fn)(void *arg, uint32_t offset, void *buf,
+        size_t size);
+
+typedef struct font_stream_t font_stream_t;
+
+typedef struct font_stream_stats_t {
+    uint32_t hits;
+    uint32_t misses;
+} font_stream_stats_t;
+
+/* Fonts compiled to C by mkfont.py --c. Glyphs are kept in arrays of
+ * consecutive code points, with data set to NULL for code points that have no
+ * glyph, and the ASCII ones are also indexed directly.
+ * kerning has the same layout as in a font file, or is NULL. A font_table_t
+ * can be passed anywhere a font blob is accepted.
+ */
+typedef struct font_table_glyph_t {
+    int16_t offset_x;
+    int16_t offset_y;
+    uint16_t width;
+    uint16_t height;
+    const uint8_t *data;
+    bool rle;
+} font_table_glyph_t;
+
+typedef struct font_table_range_t {
+    uint32_t first;
+    uint32_t last;
+    const font_table_glyph_t *glyphs;
+} font_table_range_t;
+
+typedef struct font_table_t {
+    uint32_t magic;
+    uint8_t flags;
+    uint16_t ascent;
+    uint16_t descent;
+    uint16_t range_count;
+    const font_table_range_t *ranges;
+    const void *kerning;
+    const font_table_glyph_t *ascii[128];
+} font_table_t;
+
+
+font_stream_t *font_stream_open(font_read_fn read_fn, void *arg,
+        int cache_slots);
+void font_stream_free(font_stream_t *stream);
+void font_stream_get_stats(const font_stream_t *stream,
+        font_stream_stats_t *stats);
+void font_stream_reset_stats(font_stream_t *stream);
+size_t font_stream_read_file(void *arg, uint32_t offset, void *buf,
+        size_t size);
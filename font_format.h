@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "font.h"
+
+#define FONT_MAGIC 0x746e4675
+#define FONT_STREAM_MAGIC 0x6d727473
+#define FONT_VERSION 3
+#define FONT_LATIN_COUNT 256
+#define FONT_OFFSET_RLE (1u << 31)
+
+
+typedef struct __attribute__((packed)) font_header_t {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t flags;
+    uint16_t ascent;
+    uint16_t descent;
+    uint16_t group_count;
+} font_header_t;
+
+/* offsets is where the group's glyph offsets start, one per code point from
+ * first to last. Code points without a glyph have an offset of 0.
+ */
+typedef struct __attribute__((packed)) font_group_t {
+    uint32_t first;
+    uint32_t last;
+    uint32_t offsets;
+} font_group_t;
+
+typedef struct __attribute__((packed)) font_glyph_t {
+    int16_t offset_x;
+    int16_t offset_y;
+    uint16_t width;
+    uint16_t height;
+    uint8_t data[];
+} font_glyph_t;
+
+/* Present after the latin table when FONT_FLAG_KERNING is set, followed by
+ * left_count font_kern_left_t and pair_count font_kern_pair_t, and padded to
+ * a multiple of 4 bytes.
+ */
+typedef struct __attribute__((packed)) font_kerning_t {
+    uint16_t left_count;
+    uint16_t pair_count;
+} font_kerning_t;
+
+typedef struct __attribute__((packed)) font_kern_left_t {
+    uint16_t cp;
+    uint16_t first;
+    uint16_t count;
+} font_kern_left_t;
+
+typedef struct __attribute__((packed)) font_kern_pair_t {
+    uint16_t cp;
+    int8_t value;
+} font_kern_pair_t;
+
+typedef struct font_kern_range_t {
+    const font_kern_pair_t *pairs;
+    uint16_t count;
+} font_kern_range_t;
+
+
+const font_group_t *font_find_group(const void *font, uint32_t cp);
+const font_kerning_t *font_get_kerning(const void *font);
+int font_bpp(const void *font);
+void font_kern_range(const font_kerning_t *kerning, uint32_t left,
+        font_kern_range_t *range);
+int font_kern_value(const font_kern_range_t *range, uint32_t right);
+const font_table_glyph_t *font_table_glyph(const font_table_t *table,
+        uint32_t cp);
+const void *font_stream_header(const font_stream_t *stream);
+const font_glyph_t *font_stream_glyph(font_stream_t *stream, uint32_t cp,
+        bool *rle);
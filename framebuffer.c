@@ -0,0 +1,189 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "framebuffer.h"
+#include "util.h"
+
+
+static void framebuffer_add_run(framebuffer_t *fb, size_t line_size,
+        size_t start, size_t end);
+
+
+/* Creates a front and a back buffer, both clear. The front buffer is
+ * assumed to match the display, call framebuffer_invalidate if it does not.
+ */
+framebuffer_t *framebuffer_new(int width, int height, bitmap_format_t format)
+{
+    framebuffer_t *fb = calloc(1, sizeof(framebuffer_t));
+    assert(fb != NULL);
+    fb->front = bitmap_new_format(width, height, format);
+    fb->back = bitmap_new_format(width, height, format);
+    return fb;
+}
+
+
+void framebuffer_free(framebuffer_t *fb)
+{
+    if (fb == NULL) {
+        return;
+    }
+    bitmap_free(fb->front);
+    bitmap_free(fb->back);
+    free(fb->runs);
+    free(fb);
+}
+
+
+/* Bytes per row, or per page of 8 rows for VLSB.
+ */
+size_t framebuffer_line_size(const framebuffer_t *fb)
+{
+    const bitmap_t *bitmap = fb->back;
+    if (bitmap->format == BITMAP_FORMAT_VLSB) {
+        return bitmap->width;
+    }
+    return bitmap_data_size(bitmap->width, 1, bitmap->format);
+}
+
+
+int framebuffer_line_count(const framebuffer_t *fb)
+{
+    const bitmap_t *bitmap = fb->back;
+    if (bitmap->format == BITMAP_FORMAT_VLSB) {
+        return DIV_ROUND_UP(bitmap->height, 8);
+    }
+    return bitmap->height;
+}
+
+
+/* Compares the back buffer to the front buffer and returns the changed
+ * bytes as runs in line order, setting count. Runs never cross lines, and
+ * runs in the same line that are at most gap bytes apart are merged, as
+ * sending a few unchanged bytes is usually cheaper than starting another
+ * transfer. The list is valid until the next call.
+ */
+const framebuffer_run_t *framebuffer_diff(framebuffer_t *fb, int gap,
+        size_t *count)
+{
+    size_t line_size = framebuffer_line_size(fb);
+    size_t size = line_size * framebuffer_line_count(fb);
+    const uint8_t *front = fb->front->data;
+    const uint8_t *back = fb->back->data;
+    fb->run_count = 0;
+
+    if (fb->invalid) {
+        for (size_t start = 0; start < size; start += line_size) {
+            framebuffer_add_run(fb, line_size, start, start + line_size);
+        }
+        *count = fb->run_count;
+        return fb->runs;
+    }
+
+    size_t i = 0;
+    while (i < size) {
+        /* unchanged stretches are skipped a word at a time, the buffers
+         * are allocated the same way so they share their alignment */
+        if (((uintptr_t)&back[i] & (sizeof(size_t) - 1)) == 0) {
+            for (; i + sizeof(size_t) <= size; i += sizeof(size_t)) {
+                size_t a, b;
+                memcpy(&a, &front[i], sizeof(a));
+                memcpy(&b, &back[i], sizeof(b));
+                if (a != b) {
+                    break;
+                }
+            }
+        }
+        if (i >= size) {
+            break;
+        }
+        if (front[i] == back[i]) {
+            i++;
+            continue;
+        }
+
+        size_t start = i;
+        size_t last = i;
+        size_t line_end = (i / line_size + 1) * line_size;
+        for (i++; i < line_end && i - last <= (size_t)gap + 1; i++) {
+            if (front[i] != back[i]) {
+                last = i;
+            }
+        }
+        framebuffer_add_run(fb, line_size, start, last + 1);
+        i = last + 1;
+    }
+
+    *count = fb->run_count;
+    return fb->runs;
+}
+
+
+/* The new bytes of a run, in the back buffer.
+ */
+const uint8_t *framebuffer_run_data(const framebuffer_t *fb,
+        const framebuffer_run_t *run)
+{
+    return fb->back->data + run->line * framebuffer_line_size(fb) +
+            run->offset;
+}
+
+
+/* Copies the runs of the last diff to the front buffer, once they have been
+ * sent to the display. The back buffer keeps its contents, so drawing can
+ * continue on top of them.
+ */
+void framebuffer_sync(framebuffer_t *fb)
+{
+    size_t line_size = framebuffer_line_size(fb);
+    for (size_t i = 0; i < fb->run_count; i++) {
+        const framebuffer_run_t *run = &fb->runs[i];
+        size_t offset = run->line * line_size + run->offset;
+        memcpy(fb->front->data + offset, fb->back->data + offset,
+                run->length);
+    }
+    fb->run_count = 0;
+    fb->invalid = false;
+}
+
+
+/* Exchanges the buffers' contents instead of copying, once the back buffer
+ * has been sent. The back buffer is then left with the previous frame, so
+ * this suits applications that redraw every frame completely. The bitmap_t
+ * structs stay where they are.
+ */
+void framebuffer_swap(framebuffer_t *fb)
+{
+    uint8_t *data = fb->front->data;
+    fb->front->data = fb->back->data;
+    fb->back->data = data;
+    fb->run_count = 0;
+    fb->invalid = false;
+}
+
+
+/* Makes the next diff report every byte, for example after the display has
+ * been reset.
+ */
+void framebuffer_invalidate(framebuffer_t *fb)
+{
+    fb->invalid = true;
+}
+
+
+static void framebuffer_add_run(framebuffer_t *fb, size_t line_size,
+        size_t start, size_t end)
+{
+    if (fb->run_count == fb->run_capacity) {
+        fb->run_capacity = fb->run_capacity ? fb->run_capacity * 2 : 16;
+        fb->runs = realloc(fb->runs, fb->run_capacity *
+                sizeof(framebuffer_run_t));
+        assert(fb->runs != NULL);
+    }
+
+    framebuffer_run_t *run = &fb->runs[fb->run_count++];
+    run->line = start / line_size;
+    run->offset = start % line_size;
+    run->length = end - start;
+}
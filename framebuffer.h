@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bitmap.h"
+
+
+/* length bytes starting at offset of a line, which is a row or, for VLSB, a
+ * page of 8 rows */
+typedef struct framebuffer_run_t {
+    uint16_t line;
+    uint16_t offset;
+    uint16_t length;
+} framebuffer_run_t;
+
+/* back is drawn into and front holds what the display shows. */
+typedef struct framebuffer_t {
+    bitmap_t *front;
+    bitmap_t *back;
+    bool invalid;
+    size_t run_count;
+    size_t run_capacity;
+    framebuffer_run_t *runs;
+} framebuffer_t;
+
+
+framebuffer_t *framebuffer_new(int width, int height, bitmap_format_t format);
+void framebuffer_free(framebuffer_t *fb);
+size_t framebuffer_line_size(const framebuffer_t *fb);
+int framebuffer_line_count(const framebuffer_t *fb);
+const framebuffer_run_t *framebuffer_diff(framebuffer_t *fb, int gap,
+        size_t *count);
+const uint8_t *framebuffer_run_data(const framebuffer_t *fb,
+        const framebuffer_run_t *run);
+void framebuffer_sync(framebuffer_t *fb);
+void framebuffer_swap(framebuffer_t *fb);
+void framebuffer_invalidate(framebuffer_t *fb);
@@ -0,0 +1,262 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "readout.h"
+#include "text.h"
+#include "unicode.h"
+#include "util.h"
+
+
+/* A glyph placed at x within the readout, owning the columns up to x plus
+ * width. pen is where the glyph is drawn from within the cell, which is
+ * only nonzero for digits centred in a tabular cell.
+ */
+typedef struct readout_cell_t {
+    int x;
+    int width;
+    int pen;
+    uint32_t cp;
+} readout_cell_t;
+
+/* A single line of text drawn into a fixed area of dst, which keeps the
+ * cells of the last string set so the next one only redraws what differs.
+ */
+struct readout_t {
+    bitmap_t *dst;
+    const void *font;
+    int xpos;
+    int ypos;
+    int width;
+    int height;
+    text_align_t align;
+    int digit_width;
+    bool valid;
+    readout_cell_t *cells;
+    size_t count;
+    size_t capacity;
+};
+
+static size_t readout_cells(const readout_t *readout, const char *s,
+        readout_cell_t *cells);
+static void readout_draw_cell(readout_t *readout,
+        const readout_cell_t *cell);
+
+
+/* Creates a readout covering width by height pixels of dst at xpos, ypos,
+ * with the text aligned left, center or right within it. With tabular set
+ * every digit takes the width of the widest, so digits that change do not
+ * move the glyphs around them. Returns NULL for an invalid font or an area
+ * outside dst.
+ */
+readout_t *readout_new(bitmap_t *dst, const void *font, int xpos, int ypos,
+        int width, int height, text_align_t align, bool tabular)
+{
+    uint32_t cps[10];
+    uint16_t advances[10];
+    if (text_advances(font, "0123456789", cps, advances, 10) != 10) {
+        return NULL;
+    }
+    width = MIN(width, (int)dst->width - xpos);
+    height = MIN(height, (int)dst->height - ypos);
+    if (xpos < 0 || ypos < 0 || width <= 0 || height <= 0) {
+        return NULL;
+    }
+
+    readout_t *readout = calloc(1, sizeof(readout_t));
+    assert(readout != NULL);
+    readout->dst = dst;
+    readout->font = font;
+    readout->xpos = xpos;
+    readout->ypos = ypos;
+    readout->width = width;
+    readout->height = height;
+    readout->align = align;
+    if (tabular) {
+        for (int i = 0; i < 10; i++) {
+            readout->digit_width = MAX(readout->digit_width, advances[i]);
+        }
+    }
+    return readout;
+}
+
+
+void readout_free(readout_t *readout)
+{
+    if (readout == NULL) {
+        return;
+    }
+    free(readout->cells);
+    free(readout);
+}
+
+
+/* Shows s, a single line drawn without kerning. Cells whose glyph and
+ * place are unchanged are left alone, and the columns of the rest are
+ * cleared and drawn, so the damage added to dst covers only those.
+ */
+void readout_set(readout_t *readout, const char *s)
+{
+    size_t len = strlen(s);
+    readout_cell_t cells[len ? len : 1];
+    size_t count = readout_cells(readout, s, cells);
+
+    bool draw[count ? count : 1];
+    if (!readout->valid) {
+        bitmap_fill_rect(readout->dst, bitmap_clear_pixel, readout->xpos,
+                readout->ypos, readout->width, readout->height);
+        memset(draw, true, sizeof(draw));
+        readout->valid = true;
+    } else {
+        /* both are in order of x, so a cell can only match the first old
+         * cell not left of it */
+        bool clear[readout->width];
+        memset(clear, false, sizeof(clear));
+        bool kept[readout->count ? readout->count : 1];
+        memset(kept, false, sizeof(kept));
+        size_t j = 0;
+        for (size_t i = 0; i < count; i++) {
+            const readout_cell_t *cell = &cells[i];
+            while (j < readout->count && readout->cells[j].x < cell->x) {
+                j++;
+            }
+            draw[i] = true;
+            if (j < readout->count) {
+                const readout_cell_t *old = &readout->cells[j];
+                if (old->x == cell->x && old->width == cell->width &&
+                        old->cp == cell->cp) {
+                    draw[i] = false;
+                    kept[j++] = true;
+                }
+            }
+        }
+
+        for (size_t i = 0; i < readout->count + count; i++) {
+            const readout_cell_t *cell;
+            if (i < readout->count) {
+                if (kept[i]) {
+                    continue;
+                }
+                cell = &readout->cells[i];
+            } else {
+                if (!draw[i - readout->count]) {
+                    continue;
+                }
+                cell = &cells[i - readout->count];
+            }
+            int left = MAX(cell->x, 0);
+            int right = MIN(cell->x + cell->width, readout->width);
+            for (int x = left; x < right; x++) {
+                clear[x] = true;
+            }
+        }
+
+        int x = 0;
+        while (x < readout->width) {
+            if (!clear[x]) {
+                x++;
+                continue;
+            }
+            int start = x;
+            while (x < readout->width && clear[x]) {
+                x++;
+            }
+            bitmap_fill_rect(readout->dst, bitmap_clear_pixel,
+                    readout->xpos + start, readout->ypos, x - start,
+                    readout->height);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (draw[i]) {
+            readout_draw_cell(readout, &cells[i]);
+        }
+    }
+
+    if (count > readout->capacity) {
+        readout->cells = realloc(readout->cells,
+                count * sizeof(readout_cell_t));
+        assert(readout->cells != NULL);
+        readout->capacity = count;
+    }
+    if (count) {
+        memcpy(readout->cells, cells, count * sizeof(readout_cell_t));
+    }
+    readout->count = count;
+}
+
+
+/* Clears and redraws the whole area at the next set, for when dst was
+ * drawn over.
+ */
+void readout_invalidate(readout_t *readout)
+{
+    readout->valid = false;
+}
+
+
+/* Places the glyphs of s end to end and aligns them within the readout.
+ */
+static size_t readout_cells(const readout_t *readout, const char *s,
+        readout_cell_t *cells)
+{
+    size_t len = strlen(s);
+    uint32_t cps[len ? len : 1];
+    uint16_t advances[len ? len : 1];
+    size_t count = text_advances(readout->font, s, cps, advances, len);
+
+    int x = 0;
+    for (size_t i = 0; i < count; i++) {
+        readout_cell_t *cell = &cells[i];
+        cell->x = x;
+        cell->width = advances[i];
+        cell->pen = 0;
+        cell->cp = cps[i];
+        if (readout->digit_width && cps[i] >= '0' && cps[i] <= '9') {
+            cell->width = readout->digit_width;
+            cell->pen = (readout->digit_width - advances[i]) / 2;
+        }
+        x += cell->width;
+    }
+
+    int offset = 0;
+    if (readout->align == TEXT_ALIGN_CENTER) {
+        offset = readout->width / 2 - x / 2;
+    } else if (readout->align == TEXT_ALIGN_RIGHT) {
+        offset = readout->width - x;
+    }
+    for (size_t i = 0; i < count; i++) {
+        cells[i].x += offset;
+    }
+    return count;
+}
+
+
+/* Draws the glyph of a cell clipped to the cell and the readout, into
+ * columns that are already clear.
+ */
+static void readout_draw_cell(readout_t *readout,
+        const readout_cell_t *cell)
+{
+    if (cell->cp == ' ') {
+        return;
+    }
+    int left = MAX(cell->x, 0);
+    int right = MIN(cell->x + cell->width, readout->width);
+    if (left >= right) {
+        return;
+    }
+
+    char s[5];
+    s[utf8_encode_cp(cell->cp, s)] = '\0';
+    text_config_t config = {
+        .draw_fn = bitmap_set_pixel,
+        .overflow = TEXT_OVERFLOW_BREAK_WORD,
+        .clip = { readout->xpos + left, readout->ypos, right - left,
+                readout->height },
+    };
+    int x = readout->xpos + cell->x + cell->pen;
+    text_render(readout->dst, &config, readout->font, x, readout->ypos,
+            cell->width - cell->pen + 1, readout->height, s);
+}
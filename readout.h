@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "bitmap.h"
+#include "text.h"
+
+typedef struct readout_t readout_t;
+
+
+readout_t *readout_new(bitmap_t *dst, const void *font, int xpos, int ypos,
+        int width, int height, text_align_t align, bool tabular);
+void readout_free(readout_t *readout);
+void readout_set(readout_t *readout, const char *s);
+void readout_invalidate(readout_t *readout);
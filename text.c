@@ -1,138 +1,746 @@
+#include <assert.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "font_format.h"
 #include "text.h"
 #include "unicode.h"
+#include "util.h"
 
-#define FONT_MAGIC 0x746e4675
-#define FONT_VERSION 1
+/* band boundaries fall on VLSB pages so no two bands share a byte */
+#define TEXT_BAND_ALIGN 8
+#define TEXT_VIEW_CHUNK 256
 
 
-typedef struct __attribute__((packed)) font_header_t {
-    uint32_t magic;
-    uint8_t version;
-    uint8_t flags;
-    uint16_t ascent;
-    uint16_t descent;
-} font_header_t;
-
-typedef struct __attribute__((packed)) font_group_t {
-    uint32_t first;
-    uint32_t last;
-    uint32_t offsets[];
-} font_group_t;
-
-typedef struct __attribute__((packed)) font_glyph_t {
-    int16_t offset_x;
-    int16_t offset_y;
-    bitmap_t bitmap;
-} font_glyph_t;
+/* glyph is the record's offset in a font blob, or the code point for a font
+ * stream or table, with FONT_OFFSET_RLE set for a compressed bitmap, and 0
+ * for a missing glyph. offset is where the glyph starts in the string, and c
+ * is its character if ASCII.
+ */
+typedef struct glyph_t {
+    uint32_t offset;
+    uint32_t glyph;
+    uint16_t width;
+    uint8_t c;
+    int8_t kern;
+} glyph_t;
 
 typedef struct text_state_t {
     text_config_t config;
     const void *font;
+    font_stream_t *stream;
+    const font_table_t *table;
+    const font_kerning_t *kerning;
+    uint16_t line_height;
+    uint16_t advance;
+    bitmap_format_t glyph_format;
+    bool continued;
+    int16_t glyph_left;
+    int16_t glyph_top;
+    int16_t glyph_bottom;
+    const glyph_t *elide_glyphs;
     uint16_t elide_width;
     uint16_t elide_count;
 } text_state_t;
 
-typedef struct glyph_t {
-    uint16_t width;
-    uint8_t c;
-} glyph_t;
-
+/* Line records follow the glyph records in one buffer, so they must not
+ * need more alignment than glyph_t.
+ */
 typedef struct line_t {
     uint16_t width;
-    size_t consume;
-    size_t discard;
     bool elide;
+    uint32_t consume;
+    uint32_t discard;
 } line_t;
 
+_Static_assert(_Alignof(line_t) <= _Alignof(glyph_t),
+        "line_t must pack after glyph_t");
+
+struct text_layout_t {
+    text_state_t state;
+    int width;
+    int height;
+    int line_count;
+    const line_t *lines;
+    const glyph_t *glyphs;
+    glyph_t data[];
+};
+
+/* A layout drawn in horizontal bands of dst, one job per band. */
+typedef struct text_bands_t {
+    bitmap_t *dst;
+    const text_state_t *state;
+    int xpos;
+    int ypos;
+    int width;
+    int height;
+    const glyph_t *glyphs;
+    const line_t *lines;
+    int line_count;
+    int top;
+    int bottom;
+    int band_height;
+    int (*extents)[4];
+} text_bands_t;
+
+/* Line i of the text starts at byte starts[i]. The index is extended as
+ * lines are needed and is complete once the end of the text, or a word too
+ * long to wrap, has been reached. The last lines are then laid out from
+ * the first size bytes. The text, glyph and line buffers hold what is laid
+ * out at a time, which is about one screen.
+ */
+struct text_view_t {
+    text_state_t state;
+    int width;
+    int height;
+    int rows;
+    text_read_fn read_fn;
+    void *arg;
+    char *elide_text;
+    glyph_t *elide_glyphs;
+    uint32_t top;
+    uint32_t *starts;
+    uint32_t count;
+    uint32_t capacity;
+    bool complete;
+    uint32_t size;
+    size_t scratch_size;
+    char *text;
+    glyph_t *glyphs;
+    line_t *lines;
+};
+
 static bool text_validate_font(const void *font);
-static const font_glyph_t *text_get_glyph(text_state_t *state, uint32_t cp);
+static bool text_get_glyph(const text_state_t *state, uint32_t cp,
+        glyph_t *g, font_table_glyph_t *info);
+static bool text_load_glyph(const text_state_t *state, const glyph_t *g,
+        font_table_glyph_t *info);
+static void text_glyph_info(const font_glyph_t *glyph, bool rle,
+        font_table_glyph_t *info);
+static bool text_begin(text_state_t *state, const text_config_t *config,
+        const void *font, int height, int *max_lines);
+static size_t text_elide_max(const text_state_t *state);
+static int text_layout_glyphs(text_state_t *state, int width, const char *s,
+        glyph_t *elide_glyphs, glyph_t *glyphs, line_t *lines, int max_lines);
+static void text_draw_glyphs(bitmap_t *dst, const text_state_t *state,
+        int xpos, int ypos, int width, int height, const glyph_t *glyphs,
+        const line_t *lines, int line_count, int extent[4]);
+static void text_draw_parallel(worker_pool_t *pool, bitmap_t *dst,
+        const text_state_t *state, int xpos, int ypos, int width, int height,
+        const glyph_t *glyphs, const line_t *lines, int line_count);
+static void text_draw_band(void *arg, int band);
+static void text_view_index(text_view_t *view, uint32_t line);
+static void text_view_extend(text_view_t *view);
+static bool text_view_skip_line(text_view_t *view, uint32_t offset,
+        uint32_t *end);
+static void text_view_push(text_view_t *view, uint32_t start);
+static size_t text_view_read(text_view_t *view, uint32_t start, size_t size,
+        bool *eof);
+static bool text_view_is_end(const text_view_t *view, const line_t *line,
+        size_t glyph_index, size_t glyph_count);
+static int text_view_layout(text_view_t *view, text_state_t *state,
+        uint32_t start, size_t len);
+static void text_draw_glyph(bitmap_t *dst, const text_state_t *state,
+        const glyph_t *g, int x, int y, const int clip[4], int extent[4]);
+static int text_offset_x(const text_state_t *state, int width,
+        const line_t *line);
+static int text_offset_y(const text_state_t *state, int height,
+        int line_count);
+static size_t text_measure(text_state_t *state, const char *s, size_t max,
+        glyph_t *glyphs, uint32_t *cps);
 
 
 void text_render(bitmap_t *dst, const text_config_t *config, const void *font,
         int xpos, int ypos, int width, int height, const char *s)
 {
-    if (!text_validate_font(font)) {
+    text_state_t state;
+    int max_lines;
+    if (!text_begin(&state, config, font, height, &max_lines) ||
+            max_lines == 0 || *s == '\0') {
         return;
     }
 
-    text_state_t state = { };
-    if (config) {
-        memcpy(&state.config, config, sizeof(state.config));
+    /* counting code points is much cheaper than decoding them, and keeps
+     * the records on the stack to one per glyph */
+    size_t elide_max = text_elide_max(&state);
+    glyph_t elide_glyphs[elide_max ? elide_max : 1];
+    glyph_t glyphs[utf8_len(s)];
+    line_t lines[max_lines];
+
+    int line_count = text_layout_glyphs(&state, width, s, elide_glyphs,
+            glyphs, lines, max_lines);
+    int extent[4];
+    text_draw_glyphs(dst, &state, xpos, ypos, width, height, glyphs, lines,
+            line_count, extent);
+}
+
+
+size_t text_scratch_size(const text_config_t *config, const void *font,
+        int height, const char *s)
+{
+    text_state_t state;
+    int max_lines;
+    if (!text_begin(&state, config, font, height, &max_lines) ||
+            max_lines == 0 || *s == '\0') {
+        return 0;
     }
 
-    state.config.draw_fn = state.config.draw_fn ? state.config.draw_fn :
-            bitmap_set_pixel;
-    state.font = font;
+    return (text_elide_max(&state) + strlen(s)) * sizeof(glyph_t) +
+            max_lines * sizeof(line_t);
+}
+
+
+/* Same as text_render, but glyph and line records are carved out of the
+ * caller's scratch buffer (pointer aligned) instead of the stack. Returns
+ * false without drawing if scratch_size is smaller than text_scratch_size.
+ */
+bool text_render_scratch(bitmap_t *dst, const text_config_t *config,
+        const void *font, int xpos, int ypos, int width, int height,
+        const char *s, void *scratch, size_t scratch_size)
+{
+    text_state_t state;
+    int max_lines;
+    if (!text_begin(&state, config, font, height, &max_lines)) {
+        return false;
+    }
+    if (max_lines == 0 || *s == '\0') {
+        return true;
+    }
+
+    size_t elide_max = text_elide_max(&state);
+    size_t glyph_max = strlen(s);
+    if ((elide_max + glyph_max) * sizeof(glyph_t) + max_lines *
+            sizeof(line_t) > scratch_size) {
+        return false;
+    }
+
+    glyph_t *elide_glyphs = scratch;
+    glyph_t *glyphs = elide_glyphs + elide_max;
+    line_t *lines = (line_t *)(glyphs + glyph_max);
+
+    int line_count = text_layout_glyphs(&state, width, s, elide_glyphs,
+            glyphs, lines, max_lines);
+    int extent[4];
+    text_draw_glyphs(dst, &state, xpos, ypos, width, height, glyphs, lines,
+            line_count, extent);
+    return true;
+}
+
+
+text_layout_t *text_layout(const text_config_t *config, const void *font,
+        int width, int height, const char *s)
+{
+    text_state_t state;
+    int max_lines;
+    if (!text_begin(&state, config, font, height, &max_lines)) {
+        return NULL;
+    }
+
+    size_t elide_max = text_elide_max(&state);
+    size_t glyph_max = strlen(s);
+    size_t bytes = sizeof(text_layout_t) + (elide_max + glyph_max) *
+            sizeof(glyph_t) + max_lines * sizeof(line_t);
+    text_layout_t *layout = calloc(1, bytes);
+    assert(layout != NULL);
+
+    glyph_t *elide_glyphs = layout->data;
+    glyph_t *glyphs = elide_glyphs + elide_max;
+    line_t *lines = (line_t *)(glyphs + glyph_max);
+    int line_count = text_layout_glyphs(&state, width, s, elide_glyphs,
+            glyphs, lines, max_lines);
+
+    /* pack the records that are drawn and give back the rest */
+    size_t glyph_count = 0;
+    for (int i = 0; i < line_count; i++) {
+        glyph_count += lines[i].consume + lines[i].discard;
+    }
+    memmove(elide_glyphs + state.elide_count, glyphs,
+            glyph_count * sizeof(glyph_t));
+    glyphs = elide_glyphs + state.elide_count;
+    memmove(glyphs + glyph_count, lines, line_count * sizeof(line_t));
+    bytes = sizeof(text_layout_t) + (state.elide_count + glyph_count) *
+            sizeof(glyph_t) + line_count * sizeof(line_t);
+    layout = realloc(layout, bytes);
+    assert(layout != NULL);
+
+    memcpy(&layout->state, &state, sizeof(layout->state));
+    layout->state.config.elide_text = NULL;
+    layout->state.elide_glyphs = layout->data;
+    layout->width = width;
+    layout->height = height;
+    layout->line_count = line_count;
+    layout->glyphs = layout->data + state.elide_count;
+    layout->lines = (const line_t *)(layout->glyphs + glyph_count);
+    return layout;
+}
+
+
+void text_layout_free(text_layout_t *layout)
+{
+    free(layout);
+}
+
+
+void text_layout_bounds(const text_layout_t *layout, int *x, int *y,
+        int *width, int *height)
+{
+    int line_height = layout->state.line_height;
+    int left = layout->width;
+    int right = 0;
+    int count = 0;
+
+    /* trailing empty lines take part in vertical alignment but draw
+     * nothing */
+    for (int i = 0; i < layout->line_count; i++) {
+        const line_t *line = &layout->lines[i];
+        if (line->consume == 0 && !line->elide) {
+            continue;
+        }
+        int offset_x = text_offset_x(&layout->state, layout->width, line);
+        left = MIN(left, offset_x);
+        right = MAX(right, offset_x + line->width);
+        count = i + 1;
+    }
+
+    *x = count ? left : 0;
+    *y = text_offset_y(&layout->state, layout->height, layout->line_count);
+    *width = count ? right - left : 0;
+    *height = count ? line_height + (line_height +
+            layout->state.config.line_spacing) * (count - 1) : 0;
+}
+
+
+void text_draw_layout(bitmap_t *dst, const text_layout_t *layout, int xpos,
+        int ypos)
+{
+    int extent[4];
+    text_draw_glyphs(dst, &layout->state, xpos, ypos, layout->width,
+            layout->height, layout->glyphs, layout->lines,
+            layout->line_count, extent);
+}
+
+
+/* Finds the rectangle the glyphs of a layout cover relative to the layout
+ * box, ignoring its clip and orient, and the format of the glyphs. Returns
+ * false if nothing would be drawn.
+ */
+bool text_layout_extent(const text_layout_t *layout, int *x, int *y,
+        int *width, int *height, bitmap_format_t *format)
+{
+    text_state_t state;
+    memcpy(&state, &layout->state, sizeof(state));
+    memset(&state.config.clip, 0, sizeof(state.config.clip));
+    state.config.orient = BITMAP_ORIENT_NONE;
+
+    int extent[4];
+    text_draw_glyphs(NULL, &state, 0, 0, layout->width, layout->height,
+            layout->glyphs, layout->lines, layout->line_count, extent);
+    if (extent[2] <= extent[0] || extent[3] <= extent[1]) {
+        return false;
+    }
+    *x = extent[0];
+    *y = extent[1];
+    *width = extent[2] - extent[0];
+    *height = extent[3] - extent[1];
+    *format = layout->state.glyph_format;
+    return true;
+}
+
+
+/* Draws a layout into a new bitmap in the font's glyph format that is just
+ * large enough to hold the glyphs, and sets x, y to its position relative
+ * to the layout box, leaving out any orient. Returns NULL if nothing would
+ * be drawn.
+ */
+bitmap_t *text_layout_sprite(const text_layout_t *layout, int *x, int *y)
+{
+    int width;
+    int height;
+    bitmap_format_t format;
+    if (!text_layout_extent(layout, x, y, &width, &height, &format)) {
+        return NULL;
+    }
+    bitmap_t *sprite = bitmap_new_format(width, height, format);
+    text_draw_layout_sprite(sprite, layout, *x, *y);
+    return sprite;
+}
 
-    font_header_t *header = (font_header_t *) font;
 
-    int line_height = header->ascent + header->descent;
-    if (line_height > height) {
+/* Draws a layout into sprite as text_layout_sprite does, for a sprite with
+ * other storage, at least as large as text_layout_extent reports.
+ */
+void text_draw_layout_sprite(bitmap_t *sprite, const text_layout_t *layout,
+        int x, int y)
+{
+    text_state_t state;
+    memcpy(&state, &layout->state, sizeof(state));
+    memset(&state.config.clip, 0, sizeof(state.config.clip));
+    state.config.orient = BITMAP_ORIENT_NONE;
+
+    int extent[4];
+    text_draw_glyphs(sprite, &state, -x, -y, layout->width, layout->height,
+            layout->glyphs, layout->lines, layout->line_count, extent);
+}
+
+
+/* Same as text_render, but the glyphs are drawn by the threads of pool, each
+ * into its own band of rows. The result is identical to text_render.
+ */
+void text_render_parallel(worker_pool_t *pool, bitmap_t *dst,
+        const text_config_t *config, const void *font, int xpos, int ypos,
+        int width, int height, const char *s)
+{
+    text_state_t state;
+    int max_lines;
+    if (!text_begin(&state, config, font, height, &max_lines) ||
+            max_lines == 0 || *s == '\0') {
         return;
     }
-    int max_lines = 1 + (height - line_height) /
-            (state.config.line_spacing + line_height);
 
+    size_t elide_max = text_elide_max(&state);
+    glyph_t elide_glyphs[elide_max ? elide_max : 1];
+    glyph_t glyphs[utf8_len(s)];
+    line_t lines[max_lines];
+
+    int line_count = text_layout_glyphs(&state, width, s, elide_glyphs,
+            glyphs, lines, max_lines);
+    text_draw_parallel(pool, dst, &state, xpos, ypos, width, height, glyphs,
+            lines, line_count);
+}
+
+
+/* Same as text_draw_layout, with the glyphs drawn by the threads of pool.
+ */
+void text_draw_layout_parallel(worker_pool_t *pool, bitmap_t *dst,
+        const text_layout_t *layout, int xpos, int ypos)
+{
+    text_draw_parallel(pool, dst, &layout->state, xpos, ypos, layout->width,
+            layout->height, layout->glyphs, layout->lines,
+            layout->line_count);
+}
+
+
+/* Sets width and height to the character cell of a monospace font, which
+ * every glyph is advanced by. Returns false for a proportional or invalid
+ * font.
+ */
+bool text_monospace_cell(const void *font, int *width, int *height)
+{
+    text_state_t state;
+    int max_lines;
+    if (!text_begin(&state, NULL, font, 0, &max_lines) ||
+            state.advance == 0) {
+        return false;
+    }
+    *width = state.advance;
+    *height = state.line_height;
+    return true;
+}
+
+
+/* Decodes up to max glyphs of s into cps and sets advances to how far
+ * text_render moves past each, not counting kerning. Returns the number of
+ * glyphs, which is 0 for an invalid font.
+ */
+size_t text_advances(const void *font, const char *s, uint32_t *cps,
+        uint16_t *advances, size_t max)
+{
+    text_state_t state;
+    int max_lines;
+    if (!text_begin(&state, NULL, font, 0, &max_lines) || *s == '\0') {
+        return 0;
+    }
+
+    glyph_t glyphs[max ? max : 1];
+    size_t count = text_measure(&state, s, max, glyphs, cps);
+    for (size_t i = 0; i < count; i++) {
+        advances[i] = glyphs[i].width;
+    }
+    return count;
+}
+
+
+/* Creates a view of width by height pixels onto text that is pulled through
+ * read_fn, so it need not be in memory or NUL terminated, but must not hold
+ * NUL bytes. Lines are broken as text_render would break the whole text,
+ * except that the last visible line is not elided. With the break_word and
+ * word overflow modes each line of the text is cut off and elided on its
+ * own. valign is ignored. Returns NULL if the font is invalid.
+ */
+text_view_t *text_view_new(const text_config_t *config, const void *font,
+        int width, int height, text_read_fn read_fn, void *arg)
+{
+    text_state_t state;
+    int rows;
+    if (!text_begin(&state, config, font, height, &rows)) {
+        return NULL;
+    }
+
+    text_view_t *view = calloc(1, sizeof(text_view_t));
+    assert(view != NULL);
+    memcpy(&view->state, &state, sizeof(view->state));
+    view->state.config.valign = TEXT_VALIGN_TOP;
+    view->width = width;
+    view->height = height;
+    view->rows = rows;
+    view->read_fn = read_fn;
+    view->arg = arg;
     if (state.config.elide_text) {
-        for (size_t offset = 0; state.config.elide_text[offset];) {
-            uint32_t cp;
-            offset += utf8_cp(&state.config.elide_text[offset], &cp);
-            const font_glyph_t *glyph = text_get_glyph(&state, cp);
-            if (glyph) {
-                state.elide_width += glyph->bitmap.width + glyph->offset_x +
-                        state.config.kerning;
+        view->elide_text = strdup(state.config.elide_text);
+        assert(view->elide_text != NULL);
+        view->elide_glyphs = malloc((strlen(view->elide_text) + 1) *
+                sizeof(glyph_t));
+        assert(view->elide_glyphs != NULL);
+    }
+    view->state.config.elide_text = view->elide_text;
+    text_view_push(view, 0);
+    return view;
+}
+
+
+void text_view_free(text_view_t *view)
+{
+    if (view == NULL) {
+        return;
+    }
+    free(view->lines);
+    free(view->glyphs);
+    free(view->text);
+    free(view->starts);
+    free(view->elide_glyphs);
+    free(view->elide_text);
+    free(view);
+}
+
+
+/* Forgets the lines that may have changed with the text from offset on, for
+ * example when a log has been appended to.
+ */
+void text_view_invalidate(text_view_t *view, uint32_t offset)
+{
+    while (view->count > 1 && view->starts[view->count - 1] >= offset) {
+        view->count--;
+    }
+    /* the line before the one holding offset may now take its first word */
+    if (view->count > 1) {
+        view->count--;
+    }
+    view->complete = false;
+}
+
+
+void text_view_scroll(text_view_t *view, int lines)
+{
+    if (lines < 0 && (uint32_t)-(lines + 1) >= view->top) {
+        text_view_scroll_to(view, 0);
+    } else {
+        text_view_scroll_to(view, view->top + lines);
+    }
+}
+
+
+/* Makes line the top visible line, or as close to it as the length of the
+ * text allows. Only the lines up to the end of the new screen are indexed.
+ */
+void text_view_scroll_to(text_view_t *view, uint32_t line)
+{
+    text_view_index(view, line < UINT32_MAX - view->rows ?
+            line + view->rows : UINT32_MAX);
+    if (view->complete) {
+        uint32_t last = view->count > (uint32_t)view->rows ?
+                view->count - view->rows : 0;
+        line = MIN(line, last);
+    }
+    view->top = line;
+}
+
+
+uint32_t text_view_top(const text_view_t *view)
+{
+    return view->top;
+}
+
+
+int text_view_rows(const text_view_t *view)
+{
+    return view->rows;
+}
+
+
+/* Number of lines indexed so far, which is the line count of the text once
+ * complete is set.
+ */
+uint32_t text_view_line_count(const text_view_t *view, bool *complete)
+{
+    if (complete) {
+        *complete = view->complete;
+    }
+    return view->count;
+}
+
+
+/* Draws the visible lines with the top of the view at xpos, ypos. Only the
+ * text of those lines and the line after them is read and laid out.
+ */
+void text_view_render(text_view_t *view, bitmap_t *dst, int xpos, int ypos)
+{
+    text_view_index(view, view->top + view->rows + 2);
+    int step = view->state.config.line_spacing + view->state.line_height;
+
+    uint32_t line = view->top;
+    int row = 0;
+    while (row < view->rows && line < view->count) {
+        /* the line after the last one drawn is read too, as where that one
+         * ends depends on the glyphs that follow it */
+        uint32_t start = view->starts[line];
+        uint32_t next = line + (view->rows - row) + 1;
+        size_t size = (next + 1 < view->count ? view->starts[next + 1] :
+                view->size) - start;
+        bool eof;
+        size_t len = text_view_read(view, start, size, &eof);
+        text_state_t state;
+        int line_count = text_view_layout(view, &state, start, len);
+        size_t glyph_count = utf8_len(view->text);
+
+        int count = 0;
+        size_t glyph_index = 0;
+        while (count < line_count && row + count < view->rows) {
+            const line_t *l = &view->lines[count];
+            if (text_view_is_end(view, l, glyph_index, glyph_count)) {
+                break;
             }
-            state.elide_count += 1;
+            glyph_index += l->consume + l->discard;
+            size_t end = glyph_index < glyph_count ?
+                    view->glyphs[glyph_index].offset : len;
+            if (count > 0 && count < line_count - 1 && end >= len && !eof) {
+                break;
+            }
+            count++;
+        }
+        if (count == 0) {
+            break;
         }
+
+        int extent[4];
+        text_draw_glyphs(dst, &state, xpos, ypos + row * step, view->width,
+                view->height, view->glyphs, view->lines, count, extent);
+        row += count;
+        line += count;
     }
+}
 
-    int glyph_count = utf8_len(s);
-    glyph_t glyphs[glyph_count];
-    memset(glyphs, 0, sizeof(glyphs));
-    size_t s_offset = 0;
-    int glyph_index = 0;
-    while (glyph_index < glyph_count) {
-        uint32_t cp;
-        s_offset += utf8_cp(&s[s_offset], &cp);
-        if (cp <= 0x7F) {
-            glyphs[glyph_index].c = cp;
+
+static bool text_begin(text_state_t *state, const text_config_t *config,
+        const void *font, int height, int *max_lines)
+{
+    memset(state, 0, sizeof(*state));
+    uint8_t flags;
+    if (((const font_header_t *)font)->magic == FONT_TABLE_MAGIC) {
+        state->table = font;
+        state->kerning = state->table->kerning;
+        state->line_height = state->table->ascent + state->table->descent;
+        flags = state->table->flags;
+    } else {
+        if (((const font_header_t *)font)->magic == FONT_STREAM_MAGIC) {
+            state->stream = (font_stream_t *)font;
+            font = font_stream_header(state->stream);
         }
-        const font_glyph_t *glyph = text_get_glyph(&state, cp);
-        if (glyph == NULL) {
-            glyph = text_get_glyph(&state, '?');
+        if (!text_validate_font(font)) {
+            return false;
         }
-        if (glyph != NULL) {
-            glyphs[glyph_index].width = glyph->bitmap.width + glyph->offset_x;
+        const font_header_t *header = font;
+        state->font = font;
+        state->kerning = font_get_kerning(font);
+        state->line_height = header->ascent + header->descent;
+        flags = header->flags;
+    }
+
+    if (config) {
+        memcpy(&state->config, config, sizeof(state->config));
+    }
+
+    state->config.draw_fn = state->config.draw_fn ? state->config.draw_fn :
+            bitmap_set_pixel;
+    state->glyph_left = INT16_MAX;
+    state->glyph_top = INT16_MAX;
+    state->glyph_bottom = INT16_MIN;
+    if (flags & FONT_FLAG_GRAY4) {
+        state->glyph_format = BITMAP_FORMAT_GRAY4;
+    } else if (flags & FONT_FLAG_GRAY2) {
+        state->glyph_format = BITMAP_FORMAT_GRAY2;
+    } else {
+        state->glyph_format = BITMAP_FORMAT_HMSB;
+    }
+    if (flags & FONT_FLAG_MONOSPACE) {
+        /* advances are not stored, but a space is blank up to its advance,
+         * so its width is the cell width */
+        glyph_t g;
+        font_table_glyph_t info;
+        if (text_get_glyph(state, ' ', &g, &info)) {
+            state->advance = info.width + info.offset_x;
+            state->kerning = NULL;
         }
-        glyph_index++;
     }
 
-    line_t lines[max_lines];
-    memset(lines, 0, sizeof(lines));
+    int line_height = state->line_height;
+    *max_lines = 0;
+    if (line_height <= height) {
+        *max_lines = 1 + (height - line_height) /
+                (state->config.line_spacing + line_height);
+    }
+
+    return true;
+}
+
+
+static size_t text_elide_max(const text_state_t *state)
+{
+    return state->config.elide_text ? strlen(state->config.elide_text) : 0;
+}
+
+
+static int text_layout_glyphs(text_state_t *state, int width, const char *s,
+        glyph_t *elide_glyphs, glyph_t *glyphs, line_t *lines, int max_lines)
+{
+    if (state->config.elide_text) {
+        state->elide_count = text_measure(state, state->config.elide_text,
+                SIZE_MAX, elide_glyphs, NULL);
+        for (int i = 0; i < state->elide_count; i++) {
+            state->elide_width += elide_glyphs[i].width +
+                    elide_glyphs[i].kern + state->config.kerning;
+        }
+        state->elide_glyphs = elide_glyphs;
+    }
+
+    int glyph_count = text_measure(state, s, SIZE_MAX, glyphs, NULL);
+    int glyph_index = 0;
+
+    memset(lines, 0, sizeof(line_t) * max_lines);
     bool done = false;
     int line_index = 0;    
     glyph_index = 0;
     while (!done && line_index < max_lines) {
         while (glyph_index < glyph_count) {
+            /* pair kerning does not apply to the first glyph of a line */
+            int kern = lines[line_index].consume ? glyphs[glyph_index].kern :
+                    0;
             if (glyphs[glyph_index].c == '\n') {
                 lines[line_index].discard++;
                 glyph_index++;
                 break;
-            } else if (lines[line_index].width + glyphs[glyph_index].width <
-                    width) {
-                lines[line_index].width += glyphs[glyph_index].width;
-                if (glyph_index >= 1) {
-                    lines[line_index].width += state.config.kerning;
+            } else if (lines[line_index].width + glyphs[glyph_index].width +
+                    kern < width) {
+                lines[line_index].width += glyphs[glyph_index].width + kern;
+                if (glyph_index >= 1 || state->continued) {
+                    lines[line_index].width += state->config.kerning;
                 }
                 lines[line_index].consume++;
                 glyph_index++;
-            } else if (state.config.overflow == TEXT_OVERFLOW_BREAK_WORD) {
-                while (lines[line_index].width + state.elide_width >
+            } else if (state->config.overflow == TEXT_OVERFLOW_BREAK_WORD) {
+                while (lines[line_index].width + state->elide_width >
                         width) {
                     glyph_index--;
                     if (lines[line_index].consume <= 0 || glyph_index < 0) {
@@ -141,16 +749,17 @@ void text_render(bitmap_t *dst, const text_config_t *config, const void *font,
                     }
                     lines[line_index].width -= glyphs[glyph_index].width;
                     if (lines[line_index].consume > 1) {
-                        lines[line_index].width -= state.config.kerning;
+                        lines[line_index].width -= state->config.kerning +
+                                glyphs[glyph_index].kern;
                     }
                     lines[line_index].consume--;
                 } 
                 lines[line_index].elide = true;
-                lines[line_index].width += state.elide_width;
+                lines[line_index].width += state->elide_width;
                 done = true;
                 goto done;
-            } else if (state.config.overflow == TEXT_OVERFLOW_WORD) {
-                while (lines[line_index].width + state.elide_width >
+            } else if (state->config.overflow == TEXT_OVERFLOW_WORD) {
+                while (lines[line_index].width + state->elide_width >
                         width) {
                     glyph_index--;
                     if (lines[line_index].consume <= 0 || glyph_index < 0) {
@@ -159,7 +768,8 @@ void text_render(bitmap_t *dst, const text_config_t *config, const void *font,
                     }
                     lines[line_index].width -= glyphs[glyph_index].width;
                     if (lines[line_index].consume > 1) {
-                        lines[line_index].width -= state.config.kerning;
+                        lines[line_index].width -= state->config.kerning +
+                                glyphs[glyph_index].kern;
                     }
                     lines[line_index].consume--;
                 } 
@@ -172,21 +782,23 @@ void text_render(bitmap_t *dst, const text_config_t *config, const void *font,
                     }
                     lines[line_index].width -= glyphs[glyph_index].width;
                     if (lines[line_index].consume > 1) {
-                        lines[line_index].width -= state.config.kerning;
+                        lines[line_index].width -= state->config.kerning +
+                                glyphs[glyph_index].kern;
                     }
                     lines[line_index].consume--;
                 }
-                while (glyphs[glyph_index].c == ' ') {
+                while (glyph_index < glyph_count &&
+                        glyphs[glyph_index].c == ' ') {
                     lines[line_index].discard++;
                     glyph_index++;
                 }
                 lines[line_index].elide = true;
-                lines[line_index].width += state.elide_width;
+                lines[line_index].width += state->elide_width;
                 done = true;
                 goto done;
-            } else if (state.config.overflow == TEXT_OVERFLOW_WRAP) {
+            } else if (state->config.overflow == TEXT_OVERFLOW_WRAP) {
                 if (line_index + 1 >= max_lines) {
-                    while (lines[line_index].width + state.elide_width >
+                    while (lines[line_index].width + state->elide_width >
                             width) {
                         glyph_index--;
                         if (lines[line_index].consume <= 0 || glyph_index < 0) {
@@ -195,21 +807,24 @@ void text_render(bitmap_t *dst, const text_config_t *config, const void *font,
                         }
                         lines[line_index].width -= glyphs[glyph_index].width;
                         if (lines[line_index].consume > 1) {
-                            lines[line_index].width -= state.config.kerning;
+                            lines[line_index].width -=
+                                    state->config.kerning +
+                                    glyphs[glyph_index].kern;
                         }
                         lines[line_index].consume--;
                     } 
                     lines[line_index].elide = true;
-                    lines[line_index].width += state.elide_width;
+                    lines[line_index].width += state->elide_width;
                 }
-                while (glyphs[glyph_index].c == ' ') {
+                while (glyph_index < glyph_count &&
+                        glyphs[glyph_index].c == ' ') {
                     lines[line_index].discard++;
                     glyph_index++;
                 }
                 break;
-            } else if (state.config.overflow == TEXT_OVERFLOW_WRAP_WORD) {
+            } else if (state->config.overflow == TEXT_OVERFLOW_WRAP_WORD) {
                 if (line_index + 1 >= max_lines) {
-                    while (lines[line_index].width + state.elide_width >
+                    while (lines[line_index].width + state->elide_width >
                             width) {
                         glyph_index--;
                         if (lines[line_index].consume <= 0 || glyph_index < 0) {
@@ -218,12 +833,14 @@ void text_render(bitmap_t *dst, const text_config_t *config, const void *font,
                         }
                         lines[line_index].width -= glyphs[glyph_index].width;
                         if (lines[line_index].consume > 1) {
-                            lines[line_index].width -= state.config.kerning;
+                            lines[line_index].width -=
+                                    state->config.kerning +
+                                    glyphs[glyph_index].kern;
                         }
                         lines[line_index].consume--;
                     } 
                     lines[line_index].elide = true;
-                    lines[line_index].width += state.elide_width;
+                    lines[line_index].width += state->elide_width;
                 }
                 while (lines[line_index].consume > 0 &&
                         glyphs[glyph_index].c != ' ') {
@@ -234,11 +851,13 @@ void text_render(bitmap_t *dst, const text_config_t *config, const void *font,
                     }
                     lines[line_index].width -= glyphs[glyph_index].width;
                     if (lines[line_index].consume > 1) {
-                        lines[line_index].width -= state.config.kerning;
+                        lines[line_index].width -= state->config.kerning +
+                                glyphs[glyph_index].kern;
                     }
                     lines[line_index].consume--;
                 }
-                while (glyphs[glyph_index].c == ' ') {
+                while (glyph_index < glyph_count &&
+                        glyphs[glyph_index].c == ' ') {
                     lines[line_index].discard++;
                     glyph_index++;
                 }
@@ -254,82 +873,362 @@ void text_render(bitmap_t *dst, const text_config_t *config, const void *font,
 done:
         line_index++;
     }
-    int line_count = line_index;
+    return line_index;
+}
+
 
-    int offset_y = 0;
-    if (state.config.valign == TEXT_VALIGN_MIDDLE) {
-        offset_y = height / 2 - (line_height + (line_height +
-                state.config.line_spacing) * (line_count - 1)) / 2;
-    } else if (state.config.valign == TEXT_VALIGN_BOTTOM) {
-        offset_y = height - (line_height + (line_height +
-                state.config.line_spacing) * (line_count - 1));
+/* Draws the laid out lines and sets extent (left, top, right, bottom) to
+ * the area covered. With a NULL dst only the extent is computed. Lines and
+ * glyphs outside the clip are skipped using the font's glyph bounds, before
+ * any glyph is loaded.
+ */
+static void text_draw_glyphs(bitmap_t *dst, const text_state_t *state,
+        int xpos, int ypos, int width, int height, const glyph_t *glyphs,
+        const line_t *lines, int line_count, int extent[4])
+{
+    int line_height = state->line_height;
+    int offset_y = text_offset_y(state, height, line_count);
+
+    /* damage is recorded once for the whole block instead of per glyph */
+    bitmap_damage_t *damage = dst ? dst->damage : NULL;
+    if (dst) {
+        dst->damage = NULL;
     }
+    extent[0] = INT_MAX;
+    extent[1] = INT_MAX;
+    extent[2] = INT_MIN;
+    extent[3] = INT_MIN;
+
+    /* positions and the clip are in dst as turned by orient */
+    bitmap_orient_t orient = state->config.orient;
+    bool turned = orient == BITMAP_ORIENT_ROTATE_90 ||
+            orient == BITMAP_ORIENT_ROTATE_270;
+    int clip[4] = { INT_MIN, INT_MIN, INT_MAX, INT_MAX };
+    if (dst) {
+        clip[0] = 0;
+        clip[1] = 0;
+        clip[2] = turned ? dst->height : dst->width;
+        clip[3] = turned ? dst->width : dst->height;
+    }
+    const bitmap_rect_t *rect = &state->config.clip;
+    if (rect->width > 0 && rect->height > 0) {
+        clip[0] = MAX(clip[0], rect->x);
+        clip[1] = MAX(clip[1], rect->y);
+        clip[2] = MIN(clip[2], rect->x + rect->width);
+        clip[3] = MIN(clip[3], rect->y + rect->height);
+    }
+    int step = state->config.line_spacing + line_height;
 
     int y = 0;
-    line_index = 0;
-    glyph_index = 0;
-    s_offset = 0;
-    while (line_index < line_count) {
-        int offset_x = 0;
-        int x = 0;
-        if (state.config.align == TEXT_ALIGN_CENTER) {
-            offset_x = width / 2 - lines[line_index].width / 2;
-        } else if (state.config.align == TEXT_ALIGN_RIGHT) {
-            offset_x = width - lines[line_index].width;
-        }
+    int line_index = 0;
+    int glyph_index = 0;
+    for (; line_index < line_count; line_index++, y += step) {
+        int offset_x = text_offset_x(state, width, &lines[line_index]);
+        int line_x = xpos + offset_x;
+        int line_y = ypos + offset_y + y;
 
-        int consumed = 0;
-        while (consumed < lines[line_index].consume) {
-            uint32_t cp;
-            s_offset += utf8_cp(&s[s_offset], &cp);
-            const font_glyph_t *glyph = text_get_glyph(&state, cp);
-            if (!glyph) {
-                glyph = text_get_glyph(&state, '?');
-            }
-            if (glyph) {
-                bitmap_blit2(dst, &glyph->bitmap, state.config.draw_fn,
-                        xpos + offset_x + x + glyph->offset_x,
-                        ypos + offset_y + y + glyph->offset_y, 0, 0, 0, 0);
-                offset_x += glyph->bitmap.width + glyph->offset_x +
-                        state.config.kerning;
+        const glyph_t *start = &glyphs[glyph_index];
+        glyph_index += lines[line_index].consume + lines[line_index].discard;
+        if (line_y + state->glyph_top >= clip[3]) {
+            if (step > 0) {
+                break;
             }
-            glyph_index++;
-            consumed++;            
+            continue;
+        } else if (line_y + state->glyph_bottom <= clip[1]) {
+            continue;
         }
-        int discarded = 0;
-        while (discarded < lines[line_index].discard) {
-            s_offset += utf8_cp(&s[s_offset], NULL);
-            glyph_index++;
-            discarded++;
+
+        const glyph_t *g = start;
+        const glyph_t *end = g + lines[line_index].consume;
+        for (; g < end; g++) {
+            if (g->glyph) {
+                line_x += g != start ? g->kern : 0;
+                if (line_x + g->width > clip[0] &&
+                        line_x + state->glyph_left < clip[2]) {
+                    text_draw_glyph(dst, state, g, line_x, line_y, clip,
+                            extent);
+                }
+                line_x += g->width + state->config.kerning;
+            }
         }
 
         if (lines[line_index].elide) {
-            int elide_index = 0;
-            int elide_offset = 0;
-            while (elide_index < state.elide_count) {
-                uint32_t cp;
-                elide_offset += utf8_cp(&state.config.elide_text[elide_offset], &cp);
-                const font_glyph_t *glyph = text_get_glyph(&state, cp);
-                if (!glyph) {
-                    glyph = text_get_glyph(&state, '?');
-                }
-                if (glyph) {
-                    bitmap_blit2(dst, &glyph->bitmap, state.config.draw_fn,
-                            xpos + offset_x + x + glyph->offset_x,
-                            ypos + offset_y + y + glyph->offset_y, 0, 0, 0, 0);
-                    offset_x += glyph->bitmap.width + glyph->offset_x +
-                            state.config.kerning;
+            g = state->elide_glyphs;
+            end = g + state->elide_count;
+            for (; g < end; g++) {
+                if (g->glyph) {
+                    line_x += g->kern;
+                    if (line_x + g->width > clip[0] &&
+                            line_x + state->glyph_left < clip[2]) {
+                        text_draw_glyph(dst, state, g, line_x, line_y, clip,
+                                extent);
+                    }
+                    line_x += g->width + state->config.kerning;
                 }
-                elide_index++;
             }
         }
+    }
 
-        line_index += 1;
-        y += state.config.line_spacing + line_height;
+    if (dst == NULL) {
+        return;
+    }
+    dst->damage = damage;
+    if (extent[2] > extent[0] && extent[3] > extent[1]) {
+        int x = extent[0];
+        int y = extent[1];
+        int w = extent[2] - extent[0];
+        int h = extent[3] - extent[1];
+        bitmap_orient_rect(dst, orient, &x, &y, &w, &h);
+        bitmap_damage_add(dst, x, y, w, h);
     }
 }
 
 
+/* Splits the rows the glyphs cover into one band per thread. Every band
+ * draws all lines clipped to its rows, so each pixel sees the same glyphs in
+ * the same order as with a single text_draw_glyphs call. Font streams are
+ * drawn on the calling thread, as their slots can not be shared, and so is
+ * turned text, whose bands would share bytes of dst.
+ */
+static void text_draw_parallel(worker_pool_t *pool, bitmap_t *dst,
+        const text_state_t *state, int xpos, int ypos, int width, int height,
+        const glyph_t *glyphs, const line_t *lines, int line_count)
+{
+    int extent[4];
+    int workers = worker_pool_size(pool);
+    if (workers == 1 || state->stream ||
+            state->config.orient != BITMAP_ORIENT_NONE) {
+        text_draw_glyphs(dst, state, xpos, ypos, width, height, glyphs, lines,
+                line_count, extent);
+        return;
+    }
+
+    text_draw_glyphs(NULL, state, xpos, ypos, width, height, glyphs, lines,
+            line_count, extent);
+    int top = MAX(extent[1], 0) & ~(TEXT_BAND_ALIGN - 1);
+    int bottom = MIN(extent[3], (int)dst->height);
+    if (bottom <= top) {
+        return;
+    }
+    int band_height = DIV_ROUND_UP(bottom - top, workers);
+    band_height = DIV_ROUND_UP(band_height, TEXT_BAND_ALIGN) *
+            TEXT_BAND_ALIGN;
+    int band_count = DIV_ROUND_UP(bottom - top, band_height);
+
+    int extents[band_count][4];
+    text_bands_t bands = {
+        .dst = dst,
+        .state = state,
+        .xpos = xpos,
+        .ypos = ypos,
+        .width = width,
+        .height = height,
+        .glyphs = glyphs,
+        .lines = lines,
+        .line_count = line_count,
+        .top = top,
+        .bottom = bottom,
+        .band_height = band_height,
+        .extents = extents,
+    };
+    worker_pool_run(pool, text_draw_band, &bands, band_count);
+
+    /* the bands' extents add up to what a single pass would cover */
+    extent[0] = INT_MAX;
+    extent[1] = INT_MAX;
+    extent[2] = INT_MIN;
+    extent[3] = INT_MIN;
+    for (int i = 0; i < band_count; i++) {
+        extent[0] = MIN(extent[0], extents[i][0]);
+        extent[1] = MIN(extent[1], extents[i][1]);
+        extent[2] = MAX(extent[2], extents[i][2]);
+        extent[3] = MAX(extent[3], extents[i][3]);
+    }
+    if (extent[2] > extent[0] && extent[3] > extent[1]) {
+        bitmap_damage_add(dst, extent[0], extent[1], extent[2] - extent[0],
+                extent[3] - extent[1]);
+    }
+}
+
+
+static void text_draw_band(void *arg, int band)
+{
+    const text_bands_t *bands = arg;
+    int *extent = bands->extents[band];
+    extent[0] = INT_MAX;
+    extent[1] = INT_MAX;
+    extent[2] = INT_MIN;
+    extent[3] = INT_MIN;
+
+    /* each band gets its own dst, as text_draw_glyphs detaches the damage
+     * while drawing, and damage is recorded once by the caller */
+    bitmap_t dst = *bands->dst;
+    dst.damage = NULL;
+    text_state_t state = *bands->state;
+    bitmap_rect_t *clip = &state.config.clip;
+    int y1 = bands->top + band * bands->band_height;
+    int y2 = MIN(y1 + bands->band_height, bands->bottom);
+    int x1 = 0;
+    int x2 = dst.width;
+    if (clip->width > 0 && clip->height > 0) {
+        x1 = MAX(x1, clip->x);
+        y1 = MAX(y1, clip->y);
+        x2 = MIN(x2, clip->x + clip->width);
+        y2 = MIN(y2, clip->y + clip->height);
+    }
+    if (x2 <= x1 || y2 <= y1) {
+        return;
+    }
+    *clip = (bitmap_rect_t) { x1, y1, x2 - x1, y2 - y1 };
+
+    text_draw_glyphs(&dst, &state, bands->xpos, bands->ypos, bands->width,
+            bands->height, bands->glyphs, bands->lines, bands->line_count,
+            extent);
+}
+
+
+/* Blits the part of one glyph inside clip (left, top, right, bottom) with
+ * its origin at x, y, unless dst is NULL, and grows extent to cover it.
+ */
+static void text_draw_glyph(bitmap_t *dst, const text_state_t *state,
+        const glyph_t *g, int x, int y, const int clip[4], int extent[4])
+{
+    font_table_glyph_t glyph;
+    if (!text_load_glyph(state, g, &glyph)) {
+        return;
+    }
+
+    x += glyph.offset_x;
+    y += glyph.offset_y;
+    int x1 = MAX(x, clip[0]);
+    int y1 = MAX(y, clip[1]);
+    int x2 = MIN(x + glyph.width, clip[2]);
+    int y2 = MIN(y + glyph.height, clip[3]);
+    if (x2 <= x1 || y2 <= y1) {
+        return;
+    }
+    extent[0] = MIN(extent[0], x1);
+    extent[1] = MIN(extent[1], y1);
+    extent[2] = MAX(extent[2], x2);
+    extent[3] = MAX(extent[3], y2);
+    if (dst == NULL) {
+        return;
+    }
+
+    bitmap_orient_t orient = state->config.orient;
+    if (glyph.rle && orient == BITMAP_ORIENT_NONE) {
+        bitmap_rect_t rect = { x1, y1, x2 - x1, y2 - y1 };
+        bitmap_blit_rle_clip(dst, glyph.data, glyph.width, glyph.height,
+                state->config.draw_fn, x, y, &rect);
+        return;
+    }
+
+    /* compressed glyphs are turned from a copy decoded on the stack */
+    bitmap_t src = {
+        .width = glyph.width,
+        .height = glyph.height,
+        .format = state->glyph_format,
+        .data = (uint8_t *)glyph.data,
+    };
+    uint8_t data[glyph.rle ? bitmap_data_size(glyph.width, glyph.height,
+            BITMAP_FORMAT_HMSB) : 1];
+    if (glyph.rle) {
+        memset(data, 0, sizeof(data));
+        src.format = BITMAP_FORMAT_HMSB;
+        src.data = data;
+        bitmap_blit_rle(&src, glyph.data, glyph.width, glyph.height,
+                bitmap_set_pixel, 0, 0);
+    }
+    int w = x2 - x1;
+    int h = y2 - y1;
+    int dst_x = x1;
+    int dst_y = y1;
+    bitmap_orient_rect(dst, orient, &dst_x, &dst_y, &w, &h);
+    bitmap_blit_orient(dst, &src, state->config.draw_fn, orient, dst_x,
+            dst_y, x1 - x, y1 - y, x2 - x1, y2 - y1);
+}
+
+
+static int text_offset_x(const text_state_t *state, int width,
+        const line_t *line)
+{
+    if (state->config.align == TEXT_ALIGN_CENTER) {
+        return width / 2 - line->width / 2;
+    } else if (state->config.align == TEXT_ALIGN_RIGHT) {
+        return width - line->width;
+    }
+    return 0;
+}
+
+
+static int text_offset_y(const text_state_t *state, int height,
+        int line_count)
+{
+    int line_height = state->line_height;
+
+    if (state->config.valign == TEXT_VALIGN_MIDDLE) {
+        return height / 2 - (line_height + (line_height +
+                state->config.line_spacing) * (line_count - 1)) / 2;
+    } else if (state->config.valign == TEXT_VALIGN_BOTTOM) {
+        return height - (line_height + (line_height +
+                state->config.line_spacing) * (line_count - 1));
+    }
+    return 0;
+}
+
+
+/* Decodes s once, up to max code points, resolving each to its glyph (or
+ * the '?' fallback) and its advance, and storing the code points in cps if
+ * not NULL. Returns the number of glyphs written.
+ */
+static size_t text_measure(text_state_t *state, const char *s, size_t max,
+        glyph_t *glyphs, uint32_t *cps)
+{
+    size_t count = 0;
+    size_t offset = 0;
+    font_kern_range_t kern = { NULL, 0 };
+    while (s[offset] && count < max) {
+        glyph_t *g = &glyphs[count];
+        uint32_t cp;
+        g->offset = offset;
+        offset += utf8_cp(&s[offset], &cp);
+        if (cps) {
+            cps[count] = cp;
+        }
+        count++;
+        g->c = cp <= 0x7F ? cp : 0;
+        font_table_glyph_t glyph;
+        bool found = text_get_glyph(state, cp, g, &glyph);
+        if (!found) {
+            cp = '?';
+            found = text_get_glyph(state, cp, g, &glyph);
+        }
+        if (found && state->advance) {
+            g->width = state->advance;
+        } else {
+            g->width = found ? glyph.width + glyph.offset_x : 0;
+        }
+        if (found && glyph.width && glyph.height) {
+            state->glyph_left = MIN(state->glyph_left, glyph.offset_x);
+            state->glyph_top = MIN(state->glyph_top, glyph.offset_y);
+            state->glyph_bottom = MAX(state->glyph_bottom,
+                    glyph.offset_y + glyph.height);
+        }
+
+        /* the pairs for the previous glyph are found once, so each glyph
+         * costs a search of a short list */
+        g->kern = kern.count && found ? font_kern_value(&kern, cp) : 0;
+        if (state->kerning) {
+            if (found) {
+                font_kern_range(state->kerning, cp, &kern);
+            } else {
+                kern.count = 0;
+            }
+        }
+    }
+    return count;
+}
+
 static bool text_validate_font(const void *font)
 {
     font_header_t *header = (font_header_t *)font;
@@ -346,23 +1245,271 @@ static bool text_validate_font(const void *font)
 }
 
 
-static const font_glyph_t *text_get_glyph(text_state_t *state, uint32_t cp)
+/* Resolves cp to its glyph, filling in info and the glyph field of g.
+ * Glyphs from every kind of font are described the way a compiled font
+ * table stores them. For a font stream the bitmap is only valid until the
+ * next lookup.
+ */
+static bool text_get_glyph(const text_state_t *state, uint32_t cp,
+        glyph_t *g, font_table_glyph_t *info)
 {
-    const font_group_t *group = (const font_group_t *)(state->font +
-            sizeof(font_header_t));
+    g->glyph = 0;
 
-    while (group->first <= group->last) {
-        if (cp >= group->first && cp <= group->last) {
-            break;
+    if (state->table) {
+        const font_table_glyph_t *glyph = font_table_glyph(state->table, cp);
+        if (glyph == NULL) {
+            return false;
         }
-        group += sizeof(font_group_t) + sizeof(void *) *
-                (group->last - group->first + 1);
+        g->glyph = cp | (glyph->rle ? FONT_OFFSET_RLE : 0);
+        *info = *glyph;
+        return true;
     }
 
-    if (group->first > group->last) {
-        return NULL;
+    const font_glyph_t *glyph;
+    bool rle;
+    if (state->stream) {
+        glyph = font_stream_glyph(state->stream, cp, &rle);
+        if (glyph == NULL) {
+            return false;
+        }
+        g->glyph = cp | (rle ? FONT_OFFSET_RLE : 0);
+    } else {
+        const font_group_t *group = font_find_group(state->font, cp);
+        if (group == NULL) {
+            return false;
+        }
+
+        const uint8_t *font = state->font;
+        const uint32_t *offsets = (const uint32_t *)(font + group->offsets);
+        uint32_t offset = offsets[cp - group->first];
+        if (offset == 0) {
+            return false;
+        }
+        rle = offset & FONT_OFFSET_RLE;
+        g->glyph = offset;
+        glyph = (const font_glyph_t *)(font + (offset & ~FONT_OFFSET_RLE));
+    }
+    text_glyph_info(glyph, rle, info);
+    return true;
+}
+
+
+static bool text_load_glyph(const text_state_t *state, const glyph_t *g,
+        font_table_glyph_t *info)
+{
+    uint32_t id = g->glyph & ~FONT_OFFSET_RLE;
+    const font_glyph_t *glyph;
+    if (state->table) {
+        *info = *font_table_glyph(state->table, id);
+        return true;
+    } else if (state->stream) {
+        bool rle;
+        glyph = font_stream_glyph(state->stream, id, &rle);
+        if (glyph == NULL) {
+            return false;
+        }
+    } else {
+        glyph = (const font_glyph_t *)((const uint8_t *)state->font + id);
+    }
+    text_glyph_info(glyph, g->glyph & FONT_OFFSET_RLE, info);
+    return true;
+}
+
+
+static void text_glyph_info(const font_glyph_t *glyph, bool rle,
+        font_table_glyph_t *info)
+{
+    info->offset_x = glyph->offset_x;
+    info->offset_y = glyph->offset_y;
+    info->width = glyph->width;
+    info->height = glyph->height;
+    info->data = glyph->data;
+    info->rle = rle;
+}
+
+
+/* Extends the index until it holds line or is complete.
+ */
+static void text_view_index(text_view_t *view, uint32_t line)
+{
+    while (!view->complete && view->count <= line) {
+        text_view_extend(view);
+    }
+}
+
+
+/* Adds at least one line to the index, or completes it. Text is read from
+ * the start of the last indexed line, and a laid out line is only trusted
+ * if it ends before the text read does, as the glyphs that follow can
+ * change where it breaks. The read grows until a line is found.
+ */
+static void text_view_extend(text_view_t *view)
+{
+    uint32_t start = view->starts[view->count - 1];
+    size_t size = TEXT_VIEW_CHUNK;
+
+    while (true) {
+        bool eof;
+        size_t len = text_view_read(view, start, size, &eof);
+        text_state_t state;
+        int line_count = text_view_layout(view, &state, start, len);
+        size_t glyph_count = utf8_len(view->text);
+
+        size_t glyph_index = 0;
+        bool added = false;
+        for (int i = 0; i < line_count; i++) {
+            const line_t *line = &view->lines[i];
+            if (text_view_is_end(view, line, glyph_index, glyph_count)) {
+                if (glyph_index < glyph_count || eof) {
+                    view->complete = true;
+                    view->size = start + len;
+                    return;
+                }
+                break;
+            }
+            glyph_index += line->consume + line->discard;
+
+            if (i < line_count - 1) {
+                size_t end = glyph_index < glyph_count ?
+                        view->glyphs[glyph_index].offset : len;
+                if (end >= len) {
+                    if (!eof) {
+                        break;
+                    }
+                    continue;
+                }
+                text_view_push(view, start + end);
+                added = true;
+                continue;
+            }
+
+            /* a line cut off by the overflow mode ends at the next newline,
+             * which may be well past the text laid out */
+            for (; glyph_index < glyph_count; glyph_index++) {
+                if (view->glyphs[glyph_index].c == '\n') {
+                    size_t end = view->glyphs[glyph_index].offset + 1;
+                    if (end < len || !eof) {
+                        text_view_push(view, start + end);
+                        return;
+                    }
+                    break;
+                }
+            }
+            uint32_t end;
+            if (eof || !text_view_skip_line(view, start + len, &end)) {
+                view->complete = true;
+                view->size = eof ? start + len : end;
+                return;
+            }
+            text_view_push(view, end);
+            return;
+        }
+        if (added) {
+            return;
+        }
+        size *= 2;
+    }
+}
+
+
+/* Finds the end of the line that continues at offset. Returns false and
+ * sets end to the end of the text if there is no newline.
+ */
+static bool text_view_skip_line(text_view_t *view, uint32_t offset,
+        uint32_t *end)
+{
+    while (true) {
+        size_t n = view->read_fn(view->arg, offset, view->text,
+                view->scratch_size);
+        const char *p = memchr(view->text, '\n', n);
+        if (p) {
+            *end = offset + (p - view->text) + 1;
+            return true;
+        }
+        offset += n;
+        if (n < view->scratch_size) {
+            *end = offset;
+            return false;
+        }
+    }
+}
+
+
+static void text_view_push(text_view_t *view, uint32_t start)
+{
+    if (view->count == view->capacity) {
+        view->capacity = view->capacity ? view->capacity * 2 : 64;
+        view->starts = realloc(view->starts, view->capacity *
+                sizeof(uint32_t));
+        assert(view->starts != NULL);
+    }
+    view->starts[view->count++] = start;
+}
+
+
+/* Reads up to size bytes at start into the text buffer, growing the
+ * buffers to match. The text is cut before a code point that may continue
+ * in the next read, and eof is set if it reaches the end of the text.
+ */
+static size_t text_view_read(text_view_t *view, uint32_t start, size_t size,
+        bool *eof)
+{
+    if (size > view->scratch_size || view->text == NULL) {
+        view->scratch_size = MAX(size, (size_t)TEXT_VIEW_CHUNK);
+        free(view->text);
+        free(view->glyphs);
+        free(view->lines);
+        view->text = malloc(view->scratch_size + 1);
+        view->glyphs = malloc(view->scratch_size * sizeof(glyph_t));
+        view->lines = malloc((view->scratch_size + 1) * sizeof(line_t));
+        assert(view->text && view->glyphs && view->lines);
+    }
+    size_t len = view->read_fn(view->arg, start, view->text, size);
+    *eof = len < size || (view->complete && start + len >= view->size);
+    if (!*eof) {
+        size_t i = len;
+        while (i > 0 && len - i < 3 && (view->text[i - 1] & 0xC0) == 0x80) {
+            i--;
+        }
+        if (i > 0) {
+            uint8_t lead = view->text[i - 1];
+            size_t need = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 :
+                    lead >= 0xC0 ? 2 : 1;
+            if (len - (i - 1) < need) {
+                len = i - 1;
+            }
+        }
+    }
+    view->text[len] = '\0';
+    return len;
+}
+
+
+/* Lays out the text buffer, which was read from start, with no limit on the
+ * number of lines. Returns the line count and sets state for drawing.
+ */
+static int text_view_layout(text_view_t *view, text_state_t *state,
+        uint32_t start, size_t len)
+{
+    memcpy(state, &view->state, sizeof(*state));
+    state->continued = start > 0;
+    return text_layout_glyphs(state, view->width, view->text,
+            view->elide_glyphs, view->glyphs, view->lines, len + 1);
+}
+
+
+/* An empty line ends the layout at the end of the text, or where a word is
+ * too long for a line when wrapping, which ends the text as with
+ * text_render. The cut off modes leave lines empty when not even the first
+ * word fits, and those are drawn as any other.
+ */
+static bool text_view_is_end(const text_view_t *view, const line_t *line,
+        size_t glyph_index, size_t glyph_count)
+{
+    if (line->consume > 0 || line->discard > 0 || line->elide) {
+        return false;
     }
-    
-    size_t i = cp - group->first;
-    return (const font_glyph_t *)(state->font + group->offsets[i]);
+    return glyph_index >= glyph_count ||
+            view->state.config.overflow == TEXT_OVERFLOW_WRAP ||
+            view->state.config.overflow == TEXT_OVERFLOW_WRAP_WORD;
 }
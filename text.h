@@ -1,11 +1,16 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "bitmap.h"
+#include "worker_pool.h"
 
 
 #define FONT_FLAG_MONOSPACE (1 << 0)
+#define FONT_FLAG_KERNING (1 << 1)
+#define FONT_FLAG_GRAY2 (1 << 2)
+#define FONT_FLAG_GRAY4 (1 << 3)
 
 typedef enum text_align_t {
     TEXT_ALIGN_LEFT,
@@ -35,8 +40,55 @@ typedef struct text_config_t {
     char *elide_text;
     int8_t kerning;
     int8_t line_spacing;
+    bitmap_rect_t clip; /* in dst coordinates, empty for all of dst */
+    bitmap_orient_t orient; /* how the text is turned onto dst */
 } text_config_t;
 
+typedef struct text_layout_t text_layout_t;
+
+typedef struct text_view_t text_view_t;
+
+/* Reads size bytes of text at offset into buf, returning the number of bytes
+ * read, which is less than size only at the end of the text.
+ */
+typedef size_t (*text_read_fn)(void *arg, uint32_t offset, void *buf,
+        size_t size);
+
 
 void text_render(bitmap_t *dst, const text_config_t *config, const void *font,
-        int xpos, int ypos, int width, int height, const char *s);
\ No newline at end of file
+        int xpos, int ypos, int width, int height, const char *s);
+size_t text_scratch_size(const text_config_t *config, const void *font,
+        int height, const char *s);
+bool text_render_scratch(bitmap_t *dst, const text_config_t *config,
+        const void *font, int xpos, int ypos, int width, int height,
+        const char *s, void *scratch, size_t scratch_size);
+text_layout_t *text_layout(const text_config_t *config, const void *font,
+        int width, int height, const char *s);
+void text_layout_free(text_layout_t *layout);
+void text_layout_bounds(const text_layout_t *layout, int *x, int *y,
+        int *width, int *height);
+void text_draw_layout(bitmap_t *dst, const text_layout_t *layout, int xpos,
+        int ypos);
+bool text_layout_extent(const text_layout_t *layout, int *x, int *y,
+        int *width, int *height, bitmap_format_t *format);
+bitmap_t *text_layout_sprite(const text_layout_t *layout, int *x, int *y);
+void text_draw_layout_sprite(bitmap_t *sprite, const text_layout_t *layout,
+        int x, int y);
+void text_render_parallel(worker_pool_t *pool, bitmap_t *dst,
+        const text_config_t *config, const void *font, int xpos, int ypos,
+        int width, int height, const char *s);
+void text_draw_layout_parallel(worker_pool_t *pool, bitmap_t *dst,
+        const text_layout_t *layout, int xpos, int ypos);
+bool text_monospace_cell(const void *font, int *width, int *height);
+size_t text_advances(const void *font, const char *s, uint32_t *cps,
+        uint16_t *advances, size_t max);
+text_view_t *text_view_new(const text_config_t *config, const void *font,
+        int width, int height, text_read_fn read_fn, void *arg);
+void text_view_free(text_view_t *view);
+void text_view_invalidate(text_view_t *view, uint32_t offset);
+void text_view_scroll(text_view_t *view, int lines);
+void text_view_scroll_to(text_view_t *view, uint32_t line);
+uint32_t text_view_top(const text_view_t *view);
+int text_view_rows(const text_view_t *view);
+uint32_t text_view_line_count(const text_view_t *view, bool *complete);
+void text_view_render(text_view_t *view, bitmap_t *dst, int xpos, int ypos);
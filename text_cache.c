@@ -0,0 +1,404 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "text_cache.h"
+#include "util.h"
+
+#define TEXT_CACHE_BUCKETS 64
+
+
+/* Everything that changes what text_render draws apart from the strings and
+ * the clip. The draw function only matters in that xor toggles where glyphs
+ * overlap, so the sprite is drawn with either xor or set.
+ */
+typedef struct text_cache_key_t {
+    const void *font;
+    bitmap_draw_fn draw_fn;
+    int width;
+    int height;
+    uint8_t align;
+    uint8_t valign;
+    uint8_t overflow;
+    int8_t kerning;
+    int8_t line_spacing;
+    bool elide;
+} text_cache_key_t;
+
+/* s holds the string followed by the elide text when key.elide is set */
+typedef struct text_cache_entry_t {
+    struct text_cache_entry_t *prev;
+    struct text_cache_entry_t *next;
+    struct text_cache_entry_t *chain;
+    uint32_t hash;
+    size_t bytes;
+    text_cache_key_t key;
+    bitmap_t *sprite;
+    int x;
+    int y;
+    char s[];
+} text_cache_entry_t;
+
+/* Entries are kept in most recently used order and indexed by hash. */
+struct text_cache_t {
+    size_t budget;
+    bitmap_pool_t *pool;
+    text_cache_stats_t stats;
+    text_cache_entry_t *head;
+    text_cache_entry_t *tail;
+    text_cache_entry_t *buckets[TEXT_CACHE_BUCKETS];
+};
+
+static void text_cache_make_key(text_cache_key_t *key,
+        const text_config_t *config, const void *font, int width, int height);
+static uint32_t text_cache_hash(uint32_t hash, const void *data, size_t size);
+static text_cache_entry_t *text_cache_find(text_cache_t *cache,
+        const text_cache_key_t *key, uint32_t hash, const char *s,
+        const char *elide_text);
+static text_cache_entry_t *text_cache_insert(text_cache_t *cache,
+        const text_cache_key_t *key, uint32_t hash,
+        const text_config_t *config, const char *s);
+static bool text_cache_sprite(text_cache_t *cache,
+        const text_layout_t *layout, bitmap_t **sprite, int *x, int *y);
+static void text_cache_free_sprite(text_cache_t *cache, bitmap_t *sprite);
+static void text_cache_unlink(text_cache_t *cache, text_cache_entry_t *entry);
+static void text_cache_push(text_cache_t *cache, text_cache_entry_t *entry);
+static void text_cache_remove(text_cache_t *cache, text_cache_entry_t *entry);
+
+
+/* Creates a cache of rendered text that holds at most budget bytes of
+ * sprites and bookkeeping. Entries refer to fonts by address, so the cache
+ * must be cleared before a font is freed.
+ */
+text_cache_t *text_cache_new(size_t budget)
+{
+    text_cache_t *cache = calloc(1, sizeof(text_cache_t));
+    assert(cache != NULL);
+    cache->budget = budget;
+    return cache;
+}
+
+
+void text_cache_free(text_cache_t *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+    text_cache_clear(cache);
+    free(cache);
+}
+
+
+void text_cache_clear(text_cache_t *cache)
+{
+    while (cache->head) {
+        text_cache_remove(cache, cache->head);
+    }
+}
+
+
+/* Takes sprites from pool rather than the heap, or from the heap again when
+ * pool is NULL. Clears the cache, and the pool must outlive it. When the
+ * pool runs out, the least recently used entries are evicted to make room,
+ * and if that fails the text is rendered directly.
+ */
+void text_cache_set_pool(text_cache_t *cache, bitmap_pool_t *pool)
+{
+    text_cache_clear(cache);
+    cache->pool = pool;
+}
+
+
+/* Same as text_render, except that the glyphs are drawn once into a sprite
+ * and later calls with the same string, font, box size and config blit the
+ * sprite. The result is identical for the stock draw functions. Custom draw
+ * functions also see the clear pixels between glyphs.
+ */
+void text_cache_render(text_cache_t *cache, bitmap_t *dst,
+        const text_config_t *config, const void *font, int xpos, int ypos,
+        int width, int height, const char *s)
+{
+    text_cache_key_t key;
+    text_cache_make_key(&key, config, font, width, height);
+    const char *elide_text = key.elide ? config->elide_text : NULL;
+
+    uint32_t hash = text_cache_hash(2166136261u, &key, sizeof(key));
+    hash = text_cache_hash(hash, s, strlen(s) + 1);
+    if (elide_text) {
+        hash = text_cache_hash(hash, elide_text, strlen(elide_text) + 1);
+    }
+
+    text_cache_entry_t *entry = text_cache_find(cache, &key, hash, s,
+            elide_text);
+    if (entry) {
+        cache->stats.hits++;
+        text_cache_unlink(cache, entry);
+        text_cache_push(cache, entry);
+    } else {
+        cache->stats.misses++;
+        entry = text_cache_insert(cache, &key, hash, config, s);
+        if (entry == NULL) {
+            text_render(dst, config, font, xpos, ypos, width, height, s);
+            return;
+        }
+    }
+
+    if (entry->sprite == NULL) {
+        return;
+    }
+
+    /* the sprite is drawn without the clip or orient, which are applied to
+     * the blit */
+    int x = xpos + entry->x;
+    int y = ypos + entry->y;
+    int x1 = x;
+    int y1 = y;
+    int x2 = x + entry->sprite->width;
+    int y2 = y + entry->sprite->height;
+    if (config && config->clip.width > 0 && config->clip.height > 0) {
+        x1 = MAX(x1, config->clip.x);
+        y1 = MAX(y1, config->clip.y);
+        x2 = MIN(x2, config->clip.x + config->clip.width);
+        y2 = MIN(y2, config->clip.y + config->clip.height);
+        if (x2 <= x1 || y2 <= y1) {
+            return;
+        }
+    }
+    bitmap_draw_fn draw_fn = config && config->draw_fn ? config->draw_fn :
+            bitmap_set_pixel;
+    bitmap_orient_t orient = config ? config->orient : BITMAP_ORIENT_NONE;
+    int dst_x = x1;
+    int dst_y = y1;
+    int w = x2 - x1;
+    int h = y2 - y1;
+    bitmap_orient_rect(dst, orient, &dst_x, &dst_y, &w, &h);
+    bitmap_blit_orient(dst, entry->sprite, draw_fn, orient, dst_x, dst_y,
+            x1 - x, y1 - y, x2 - x1, y2 - y1);
+}
+
+
+void text_cache_get_stats(const text_cache_t *cache,
+        text_cache_stats_t *stats)
+{
+    *stats = cache->stats;
+}
+
+
+void text_cache_reset_stats(text_cache_t *cache)
+{
+    cache->stats.hits = 0;
+    cache->stats.misses = 0;
+    cache->stats.evictions = 0;
+}
+
+
+static void text_cache_make_key(text_cache_key_t *key,
+        const text_config_t *config, const void *font, int width, int height)
+{
+    /* cleared first so padding hashes and compares the same */
+    memset(key, 0, sizeof(*key));
+    key->font = font;
+    key->draw_fn = bitmap_set_pixel;
+    key->width = width;
+    key->height = height;
+    if (config) {
+        if (config->draw_fn == bitmap_xor_pixel) {
+            key->draw_fn = bitmap_xor_pixel;
+        }
+        key->align = config->align;
+        key->valign = config->valign;
+        key->overflow = config->overflow;
+        key->kerning = config->kerning;
+        key->line_spacing = config->line_spacing;
+        key->elide = config->elide_text != NULL;
+    }
+}
+
+
+/* FNV-1a */
+static uint32_t text_cache_hash(uint32_t hash, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    while (size--) {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+static text_cache_entry_t *text_cache_find(text_cache_t *cache,
+        const text_cache_key_t *key, uint32_t hash, const char *s,
+        const char *elide_text)
+{
+    text_cache_entry_t *entry = cache->buckets[hash % TEXT_CACHE_BUCKETS];
+    for (; entry; entry = entry->chain) {
+        if (entry->hash != hash || memcmp(&entry->key, key, sizeof(*key)) ||
+                strcmp(entry->s, s)) {
+            continue;
+        }
+        if (elide_text == NULL ||
+                !strcmp(entry->s + strlen(s) + 1, elide_text)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+/* Renders a new entry, evicting the least recently used entries to make
+ * room. Returns NULL if the font is invalid or the entry alone would exceed
+ * the budget.
+ */
+static text_cache_entry_t *text_cache_insert(text_cache_t *cache,
+        const text_cache_key_t *key, uint32_t hash,
+        const text_config_t *config, const char *s)
+{
+    text_config_t sprite_config = { 0 };
+    if (config) {
+        memcpy(&sprite_config, config, sizeof(sprite_config));
+    }
+    sprite_config.draw_fn = key->draw_fn;
+    sprite_config.orient = BITMAP_ORIENT_NONE;
+
+    text_layout_t *layout = text_layout(&sprite_config, key->font,
+            key->width, key->height, s);
+    if (layout == NULL) {
+        return NULL;
+    }
+    int x = 0;
+    int y = 0;
+    bitmap_t *sprite;
+    bool ok = text_cache_sprite(cache, layout, &sprite, &x, &y);
+    text_layout_free(layout);
+    if (!ok) {
+        return NULL;
+    }
+
+    size_t s_size = strlen(s) + 1;
+    size_t elide_size = key->elide ? strlen(config->elide_text) + 1 : 0;
+    size_t bytes = sizeof(text_cache_entry_t) + s_size + elide_size;
+    if (sprite) {
+        bytes += sizeof(bitmap_t) + bitmap_data_size(sprite->width,
+                sprite->height, sprite->format);
+    }
+    if (bytes > cache->budget) {
+        text_cache_free_sprite(cache, sprite);
+        return NULL;
+    }
+    while (cache->stats.bytes + bytes > cache->budget) {
+        cache->stats.evictions++;
+        text_cache_remove(cache, cache->tail);
+    }
+
+    text_cache_entry_t *entry = malloc(sizeof(text_cache_entry_t) + s_size +
+            elide_size);
+    assert(entry != NULL);
+    entry->hash = hash;
+    entry->bytes = bytes;
+    entry->key = *key;
+    entry->sprite = sprite;
+    entry->x = x;
+    entry->y = y;
+    memcpy(entry->s, s, s_size);
+    if (elide_size) {
+        memcpy(entry->s + s_size, config->elide_text, elide_size);
+    }
+
+    text_cache_entry_t **bucket = &cache->buckets[hash % TEXT_CACHE_BUCKETS];
+    entry->chain = *bucket;
+    *bucket = entry;
+    text_cache_push(cache, entry);
+    cache->stats.entries++;
+    cache->stats.bytes += bytes;
+    return entry;
+}
+
+
+/* Draws the sprite of a layout, which is NULL if nothing would be drawn.
+ * Returns false if the pool has no room even with the cache emptied.
+ */
+static bool text_cache_sprite(text_cache_t *cache,
+        const text_layout_t *layout, bitmap_t **sprite, int *x, int *y)
+{
+    if (cache->pool == NULL) {
+        *sprite = text_layout_sprite(layout, x, y);
+        return true;
+    }
+
+    int width;
+    int height;
+    bitmap_format_t format;
+    *sprite = NULL;
+    if (!text_layout_extent(layout, x, y, &width, &height, &format)) {
+        return true;
+    }
+    while ((*sprite = bitmap_pool_get(cache->pool, width, height,
+            format)) == NULL) {
+        if (cache->tail == NULL) {
+            return false;
+        }
+        cache->stats.evictions++;
+        text_cache_remove(cache, cache->tail);
+    }
+    text_draw_layout_sprite(*sprite, layout, *x, *y);
+    return true;
+}
+
+
+static void text_cache_free_sprite(text_cache_t *cache, bitmap_t *sprite)
+{
+    if (cache->pool) {
+        bitmap_pool_put(cache->pool, sprite);
+    } else {
+        bitmap_free(sprite);
+    }
+}
+
+
+static void text_cache_unlink(text_cache_t *cache, text_cache_entry_t *entry)
+{
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        cache->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache->tail = entry->prev;
+    }
+}
+
+
+/* Makes entry the most recently used.
+ */
+static void text_cache_push(text_cache_t *cache, text_cache_entry_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head) {
+        cache->head->prev = entry;
+    } else {
+        cache->tail = entry;
+    }
+    cache->head = entry;
+}
+
+
+static void text_cache_remove(text_cache_t *cache, text_cache_entry_t *entry)
+{
+    text_cache_entry_t **link = &cache->buckets[entry->hash %
+            TEXT_CACHE_BUCKETS];
+    while (*link != entry) {
+        link = &(*link)->chain;
+    }
+    *link = entry->chain;
+
+    text_cache_unlink(cache, entry);
+    cache->stats.entries--;
+    cache->stats.bytes -= entry->bytes;
+    text_cache_free_sprite(cache, entry->sprite);
+    free(entry);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bitmap.h"
+#include "bitmap_pool.h"
+#include "text.h"
+
+
+typedef struct text_cache_t text_cache_t;
+
+typedef struct text_cache_stats_t {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t entries;
+    size_t bytes;
+} text_cache_stats_t;
+
+
+text_cache_t *text_cache_new(size_t budget);
+void text_cache_free(text_cache_t *cache);
+void text_cache_clear(text_cache_t *cache);
+void text_cache_set_pool(text_cache_t *cache, bitmap_pool_t *pool);
+void text_cache_render(text_cache_t *cache, bitmap_t *dst,
+        const text_config_t *config, const void *font, int xpos, int ypos,
+        int width, int height, const char *s);
+void text_cache_get_stats(const text_cache_t *cache,
+        text_cache_stats_t *stats);
+void text_cache_reset_stats(text_cache_t *cache);
@@ -3,29 +3,50 @@
 from enum import IntFlag
 from PIL import Image, ImageDraw, ImageFont
 from struct import Struct
+import json
+import re
 import sys
 
 MAGIC = 0x746e4675
-VERSION = 1
+VERSION = 3
+LATIN_COUNT = 256
+ASCII_COUNT = 128
+OFFSET_RLE = 1 << 31
 
-header_struct = Struct('<IBBHH')
-group_struct = Struct('<II')
+header_struct = Struct('<IBBHHH')
+group_struct = Struct('<III')
 group_entry_struct = Struct('<I')
-glyph_struct = Struct('<hhHH') # glyph_t contains a bitmap_t
+latin_struct = Struct('<%dB' % LATIN_COUNT)
+glyph_struct = Struct('<hhHH')
+kerning_struct = Struct('<HH')
+kern_left_struct = Struct('<HHH')
+kern_pair_struct = Struct('<Hb')
 
 
 class Font:
     class HeaderFlag(IntFlag):
         monospace = 1
+        kerning = 2
+        gray2 = 4
+        gray4 = 8
 
-    def __init__(self, font_name, size):
+    def __init__(self, font_name, size, rle=False, kerning=False, bpp=1):
         self.font = ImageFont.truetype(font_name, size)
         self.ascent, self.descent = self.font.getmetrics()
+        self.size = size
+        self.rle = rle
+        self.kerning = kerning
+        self.bpp = bpp
+
+    def text_width(self, s):
+        # FreeTypeFont.getsize was removed in Pillow 10
+        if hasattr(self.font, 'getlength'):
+            return self.font.getlength(s)
+        width, _ = self.font.getsize(s)
+        return width
 
     def is_monospace(self):
-        i_width, _ = self.font.getsize('I')
-        w_width, _ = self.font.getsize('W')
-        return i_width == w_width
+        return self.text_width('I') == self.text_width('W')
 
     def get_glyph(self, c):
         (width, height), (x_offset, y_offset) = self.font.font.getsize(c)
@@ -37,48 +58,341 @@ class Font:
         if height == 0:
             return glyph_struct.pack(x_offset, y_offset, width, height)
 
+        if self.bpp > 1:
+            return glyph_struct.pack(x_offset, y_offset, width, height) + \
+                    self.get_gray_data(c, width, height, x_offset, y_offset)
+
         glyph = Image.new('1', (width, height))
         draw = ImageDraw.Draw(glyph)
         draw.text((-x_offset, -y_offset), c, font=self.font, fill=1)
         return glyph_struct.pack(x_offset, y_offset, width, height) + \
                 glyph.tobytes('raw')
 
-    def build(self, ranges):
+    def get_gray_data(self, c, width, height, x_offset, y_offset):
+        # anti-aliased coverage quantized to bpp bit levels, packed into rows
+        # with the leftmost pixel in the most significant bits
+        glyph = Image.new('L', (width, height))
+        draw = ImageDraw.Draw(glyph)
+        draw.text((-x_offset, -y_offset), c, font=self.font, fill=255)
+        levels = (1 << self.bpp) - 1
+        per_byte = 8 // self.bpp
+        data = bytearray()
+        for y in range(height):
+            row = [(glyph.getpixel((x, y)) * levels + 127) // 255
+                    for x in range(width)]
+            row += [0] * (-width % per_byte)
+            for i in range(0, len(row), per_byte):
+                byte = 0
+                for level in row[i:i + per_byte]:
+                    byte = byte << self.bpp | level
+                data.append(byte)
+        return bytes(data)
+
+    def get_glyph_rle(self, c):
+        (width, height), (x_offset, y_offset) = self.font.font.getsize(c)
+        glyph = Image.new('1', (width, height))
+        draw = ImageDraw.Draw(glyph)
+        draw.text((-x_offset, -y_offset), c, font=self.font, fill=1)
+        pixels = [glyph.getpixel((x, y)) for y in range(height)
+                for x in range(width)]
+        return glyph_struct.pack(x_offset, y_offset, width, height) + \
+                self.encode_rle(pixels)
+
+    @staticmethod
+    def encode_rle(pixels):
+        # each byte is a run of up to 15 clear pixels followed by a run of up
+        # to 15 set pixels, trailing clear pixels are implied by the 0 byte
+        data = bytearray()
+        i = 0
+        while any(pixels[i:]):
+            zeros = 0
+            while zeros < 15 and not pixels[i]:
+                zeros += 1
+                i += 1
+            ones = 0
+            while ones < 15 and i < len(pixels) and pixels[i]:
+                ones += 1
+                i += 1
+            data.append(zeros << 4 | ones)
+        data.append(0)
+        return bytes(data)
+
+    def get_kerning_pairs(self, code_points):
+        from fontTools.ttLib import TTFont
+
+        tt = TTFont(self.font.path)
+        scale = self.size / tt['head'].unitsPerEm
+        names = {}
+        for c, name in tt.getBestCmap().items():
+            if c in code_points:
+                names.setdefault(name, []).append(c)
+
+        # the first lookup or subtable that covers a pair wins
+        units = {}
+        if 'GPOS' in tt and tt['GPOS'].table.FeatureList:
+            gpos = tt['GPOS'].table
+            indices = set()
+            for record in gpos.FeatureList.FeatureRecord:
+                if record.FeatureTag == 'kern':
+                    indices.update(record.Feature.LookupListIndex)
+            for index in sorted(indices):
+                lookup = gpos.LookupList.Lookup[index]
+                for subtable in lookup.SubTable:
+                    if lookup.LookupType == 9:
+                        subtable = subtable.ExtSubTable
+                    if subtable.LookupType != 2:
+                        continue
+                    self.add_pair_pos(subtable, names, units)
+        elif 'kern' in tt:
+            for table in tt['kern'].kernTables:
+                for (left, right), value in getattr(table, 'kernTable',
+                        {}).items():
+                    if left in names and right in names:
+                        units.setdefault((left, right), value)
+
+        pairs = {}
+        for (left, right), value in units.items():
+            value = round(value * scale)
+            if value == 0:
+                continue
+            value = max(-128, min(127, value))
+            for a in names[left]:
+                for b in names[right]:
+                    pairs[a, b] = value
+        return pairs
+
+    @staticmethod
+    def add_pair_pos(subtable, names, units):
+        def x_advance(record):
+            return getattr(record, 'XAdvance', 0) if record else 0
+
+        coverage = [name for name in subtable.Coverage.glyphs if name in names]
+        if subtable.Format == 1:
+            for name, pair_set in zip(subtable.Coverage.glyphs,
+                    subtable.PairSet):
+                if name not in names:
+                    continue
+                for record in pair_set.PairValueRecord:
+                    if record.SecondGlyph in names:
+                        units.setdefault((name, record.SecondGlyph),
+                                x_advance(record.Value1))
+        elif subtable.Format == 2:
+            classes1 = subtable.ClassDef1.classDefs
+            classes2 = subtable.ClassDef2.classDefs
+            for left in coverage:
+                row = subtable.Class1Record[classes1.get(left, 0)]
+                for right in names:
+                    record = row.Class2Record[classes2.get(right, 0)]
+                    units.setdefault((left, right), x_advance(record.Value1))
+
+    def build_kerning(self, code_points):
+        # pairs are grouped by left code point so a lookup is one search for
+        # the left glyph and another within its short list of right glyphs
+        pairs = self.get_kerning_pairs({c for c in code_points if c <= 0xFFFF})
+        lefts = bytearray()
+        table = bytearray()
+        left_count = 0
+        for left in sorted({left for left, _ in pairs}):
+            rights = sorted((b, v) for (a, b), v in pairs.items() if a == left)
+            lefts.extend(kern_left_struct.pack(left, len(table) //
+                    kern_pair_struct.size, len(rights)))
+            left_count += 1
+            for right, value in rights:
+                table.extend(kern_pair_struct.pack(right, value))
+        pair_count = len(table) // kern_pair_struct.size
+        assert pair_count <= 0xFFFF, 'too many kerning pairs'
+        data = kerning_struct.pack(left_count, pair_count) + lefts + table
+        return data + bytes(-len(data) % 4) # keep glyph offsets aligned
+
+    def get_flags(self):
         flags = 0
         if self.is_monospace():
-            flags |= HeaderFlag.monospace
+            flags |= Font.HeaderFlag.monospace
+        if self.bpp == 2:
+            flags |= Font.HeaderFlag.gray2
+        elif self.bpp == 4:
+            flags |= Font.HeaderFlag.gray4
+        if self.kerning:
+            flags |= Font.HeaderFlag.kerning
+        return flags
+
+    @staticmethod
+    def pack_code_points(code_points, max_gap):
+        # a group costs a directory entry and a search step, while a code
+        # point without a glyph inside a group costs only its offset, so runs
+        # separated by at most max_gap missing code points share a group
+        groups = []
+        for c in sorted(code_points):
+            if groups and c - groups[-1][1] <= max_gap + 1:
+                groups[-1][1] = c
+            else:
+                groups.append([c, c])
+        return [range(first, last + 1) for first, last in groups]
+
+    @staticmethod
+    def sort_ranges(ranges):
+        ranges = sorted(ranges, key=lambda range_: range_.start)
+        for a, b in zip(ranges, ranges[1:]):
+            assert a.stop <= b.start, 'ranges overlap'
+        return ranges
+
+    def get_glyph_best(self, c):
+        # returns the glyph record and whether it is run-length encoded,
+        # which is only used where it is smaller
+        glyph = self.get_glyph(c)
+        if self.rle:
+            glyph_rle = self.get_glyph_rle(c)
+            if len(glyph_rle) < len(glyph):
+                return glyph_rle, True
+        return glyph, False
+
+    def build(self, ranges, code_points=None):
+        # code points in ranges but not in code_points get an offset of 0
+        flags = self.get_flags()
+        ranges = self.sort_ranges(ranges)
+        if code_points is None:
+            code_points = {c for range_ in ranges for c in range_}
+        kerning = self.build_kerning(code_points) if self.kerning else b''
 
         header = header_struct.pack(MAGIC, VERSION, flags, self.ascent,
-                self.descent)
+                self.descent, len(ranges))
 
-        groups_length = 0
-        for range_ in ranges:
-            size = group_struct.size + group_entry_struct.size * \
-                    (range_.stop - range_.start + 1)
-            groups_length += size
-        groups_length += group_struct.size # sentinel
+        # the group directory is sorted so it can be binary searched, and the
+        # latin table maps code points below LATIN_COUNT to group index + 1
+        offsets_start = header_struct.size + group_struct.size * \
+                len(ranges) + latin_struct.size + len(kerning)
+        offsets_length = sum(group_entry_struct.size * len(range_)
+                for range_ in ranges)
 
         groups = bytearray()
+        latin = [0] * LATIN_COUNT
+        offsets = bytearray()
         glyphs = bytearray()
-        for range_ in ranges:
-            group_length = group_struct.size + \
-                    group_entry_struct.size * (range_.stop - range_.start + 1)
-            group = bytearray(group_length)
-            group_struct.pack_into(group, 0, range_.start, range_.stop - 1)
-            
-            group_offset = group_struct.size
+        for index, range_ in enumerate(ranges):
+            groups.extend(group_struct.pack(range_.start, range_.stop - 1,
+                    offsets_start + len(offsets)))
             for c in range_:
-                glyph = self.get_glyph(chr(c))
-                glyph_offset = header_struct.size + groups_length + len(glyphs)
-                group_entry_struct.pack_into(group, group_offset, glyph_offset)
-                group_offset += group_entry_struct.size
+                if c < LATIN_COUNT:
+                    assert index < 255
+                    latin[c] = index + 1
+                if c not in code_points:
+                    offsets.extend(group_entry_struct.pack(0))
+                    continue
+                glyph_offset = offsets_start + offsets_length + len(glyphs)
+                glyph, rle = self.get_glyph_best(chr(c))
+                if rle:
+                    glyph_offset |= OFFSET_RLE
+                offsets.extend(group_entry_struct.pack(glyph_offset))
                 glyphs.extend(glyph)
+                if len(glyphs) & 1:
+                    glyphs.append(0) # keep glyph bitmaps 16-bit aligned
+
+        return header + groups + latin_struct.pack(*latin) + kerning + \
+                offsets + glyphs
+
+    def build_c(self, ranges, name, code_points=None):
+        # typed tables for font.h: the bitmaps share one array, each range
+        # gets an array of glyphs pointing into it, and ASCII code points
+        # are also indexed directly
+        ranges = self.sort_ranges(ranges)
+        if code_points is None:
+            code_points = {c for range_ in ranges for c in range_}
+        kerning = self.build_kerning(code_points) if self.kerning else b''
+        out = ['/* generated by mkfont.py, do not edit */', '',
+                '#include "font.h"', '']
 
-            groups.extend(group)
-        groups.extend(group_struct.pack(1, 0)) # sentinel
+        bitmaps = bytearray()
+        tables = []
+        ascii = {}
+        for index, range_ in enumerate(ranges):
+            entries = []
+            for i, c in enumerate(range_):
+                if c not in code_points:
+                    entries.append('    { 0, 0, 0, 0, NULL, false }, '
+                            '/* U+%04X */' % c)
+                    continue
+                glyph, rle = self.get_glyph_best(chr(c))
+                x_offset, y_offset, width, height = \
+                        glyph_struct.unpack_from(glyph)
+                entries.append('    { %d, %d, %d, %d, &%s_bitmaps[%d], %s },'
+                        ' /* U+%04X */' % (x_offset, y_offset, width, height,
+                        name, len(bitmaps), 'true' if rle else 'false', c))
+                bitmaps.extend(glyph[glyph_struct.size:])
+                if c < ASCII_COUNT:
+                    ascii[c] = '&%s_glyphs_%d[%d]' % (name, index, i)
+            tables.append(entries)
 
-        return header + groups + glyphs
+        out.append('static const uint8_t %s_bitmaps[%d] = {' % (name,
+                max(len(bitmaps), 1)))
+        out.extend(self.c_bytes(bitmaps))
+        out += ['};', '']
+        for index, entries in enumerate(tables):
+            out.append('static const font_table_glyph_t %s_glyphs_%d[] = {'
+                    % (name, index))
+            out += entries + ['};', '']
 
+        out.append('static const font_table_range_t %s_ranges[] = {' % name)
+        for index, range_ in enumerate(ranges):
+            out.append('    { 0x%04X, 0x%04X, %s_glyphs_%d },' % (
+                    range_.start, range_.stop - 1, name, index))
+        out += ['};', '']
+
+        if kerning:
+            out.append('static const uint8_t %s_kerning[] '
+                    '__attribute__((aligned(4))) = {' % name)
+            out.extend(self.c_bytes(kerning))
+            out += ['};', '']
+
+        out += ['const font_table_t %s = {' % name,
+                '    .magic = FONT_TABLE_MAGIC,',
+                '    .flags = 0x%02x,' % self.get_flags(),
+                '    .ascent = %d,' % self.ascent,
+                '    .descent = %d,' % self.descent,
+                '    .range_count = %d,' % len(ranges),
+                '    .ranges = %s_ranges,' % name,
+                '    .kerning = %s,' % ('%s_kerning' % name if kerning
+                        else 'NULL'),
+                '    .ascii = {']
+        for c in sorted(ascii):
+            out.append('        [0x%02X] = %s,' % (c, ascii[c]))
+        out += ['    },', '};', '']
+        return '\n'.join(out)
+
+    @staticmethod
+    def c_bytes(data):
+        return ['    ' + ' '.join('0x%02x,' % b for b in data[i:i + 12])
+                for i in range(0, len(data), 12)]
+
+def read_catalog(path):
+    # the characters of a UTF-8 text file, or of the msgid and msgstr strings
+    # of a gettext .po file, leaving out control characters
+    with open(path, encoding='utf-8') as f:
+        text = f.read()
+    if path.endswith('.po'):
+        text = ''.join(read_po_strings(text))
+    return {ord(c) for c in text if ord(c) >= 0x20 and
+            not 0x7F <= ord(c) <= 0x9F}
+
+def read_po_strings(text):
+    # the header is the translation of the empty msgid and is skipped
+    strings = []
+    entry = None
+    header = False
+    for line in text.splitlines():
+        line = line.strip()
+        if line.startswith('"') and entry is not None:
+            entry.append(json.loads(line))
+        elif line.startswith('msgid') or line.startswith('msgstr'):
+            keyword, _, value = line.partition(' ')
+            if keyword == 'msgid':
+                header = value == '""'
+            entry = None if header else []
+            if entry is not None:
+                entry.append(json.loads(value))
+                strings.append(entry)
+        else:
+            entry = None
+    return [''.join(entry) for entry in strings]
 
 if __name__ == '__main__':
     import argparse
@@ -86,19 +400,54 @@ if __name__ == '__main__':
     parser = argparse.ArgumentParser(add_help=False)
     parser.add_argument('--range', action='append', nargs=2,
             type=lambda x: int(x, 0), metavar=('FIRST', 'LAST'))
+    parser.add_argument('--text', action='append', metavar='FILE',
+            help='include the characters used in a UTF-8 text or .po file, '
+            'plus "?" and space; an elide text must be in one of the files '
+            'or a --range')
+    parser.add_argument('--max-gap', type=int, default=3, metavar='N',
+            help='share a group across up to N code points without a glyph')
+    parser.add_argument('--rle', action='store_true',
+            help='run-length encode glyph bitmaps')
+    parser.add_argument('--kerning', action='store_true',
+            help='include pair kerning (requires fonttools)')
+    parser.add_argument('--bpp', type=int, choices=(1, 2, 4), default=1,
+            help='bits per pixel, 2 and 4 are anti-aliased')
+    parser.add_argument('--c', action='store_true',
+            help='write C source defining a font_table_t')
+    parser.add_argument('--name',
+            help='name of the font_table_t, from OUT by default')
     parser.add_argument('FONT')
     parser.add_argument('SIZE', type=int)
     parser.add_argument('OUT')
     args = parser.parse_args()
 
-    if args.range == None:
-        print('at least one range is required', file=sys.stderr)
+    if args.range == None and args.text == None:
+        print('at least one range or text file is required', file=sys.stderr)
+        sys.exit(1)
+
+    if args.rle and args.bpp > 1:
+        print('--rle only applies to 1 bpp glyphs', file=sys.stderr)
         sys.exit(1)
 
-    ranges = []
-    for first, last in args.range:
-        ranges.append(range(first, last + 1))
+    code_points = set()
+    for first, last in args.range or []:
+        code_points.update(range(first, last + 1))
+    for path in args.text or []:
+        code_points.update(read_catalog(path))
+    if args.text:
+        # missing characters are drawn as '?', and the cell of a monospace
+        # font is the width of a space
+        code_points.update((ord('?'), ord(' ')))
+    ranges = Font.pack_code_points(code_points, args.max_gap)
 
-    with open(args.OUT, 'wb') as f:
-        font = Font(args.FONT, args.SIZE)
-        f.write(font.build(ranges))    
+    font = Font(args.FONT, args.SIZE, args.rle, args.kerning, args.bpp)
+    if args.c:
+        name = args.name
+        if name is None:
+            name = re.sub(r'\W', '_', args.OUT.rsplit('/', 1)[-1]
+                    .split('.', 1)[0])
+        with open(args.OUT, 'w') as f:
+            f.write(font.build_c(ranges, name, code_points))
+    else:
+        with open(args.OUT, 'wb') as f:
+            f.write(font.build(ranges, code_points))
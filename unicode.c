@@ -1,9 +1,13 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "unicode.h"
 
+/* the high bit of every byte in a word */
+#define UTF8_HIGH_BITS (SIZE_MAX / 0xFF * 0x80)
+
 
 static const uint8_t LEN[] = {1, 1, 1, 1, 2, 2, 3, 0};
 static const uint8_t MSK[] = {
@@ -11,6 +15,8 @@ static const uint8_t MSK[] = {
     0xFF >> 5, 0xFF >> 0, 0xFF >> 0, 0xFF >> 0
 };
 
+static inline bool utf8_ascii_word(const char *s);
+
 
 int utf8_cp(const char * restrict s, uint32_t *ch)
 {
@@ -37,11 +43,163 @@ int utf8_cp(const char * restrict s, uint32_t *ch)
 
 size_t utf8_len(const char *s)
 {
+    size_t size = strlen(s);
     size_t len = 0;
     size_t offset = 0;
-    while (s[offset]) {
+    while (offset < size) {
+        if (size - offset >= sizeof(size_t) && utf8_ascii_word(&s[offset])) {
+            offset += sizeof(size_t);
+            len += sizeof(size_t);
+            continue;
+        }
         offset += utf8_cp(&s[offset], NULL);
         len++;
     }
     return len;
-}
\ No newline at end of file
+}
+
+
+/* Decodes one code point from at most size bytes of s and returns the number
+ * of bytes used, or 0 if size is 0. Unlike utf8_cp this is strict: invalid
+ * lead bytes, overlong forms, surrogates, code points past U+10FFFF and
+ * truncated sequences decode as UTF8_REPLACEMENT, consuming the longest
+ * prefix that could have started a valid sequence.
+ */
+int utf8_decode_cp(const char *s, size_t size, uint32_t *cp)
+{
+    const uint8_t *p = (const uint8_t *)s;
+    if (size == 0) {
+        return 0;
+    }
+
+    uint8_t first = p[0];
+    if (first < 0x80) {
+        *cp = first;
+        return 1;
+    }
+
+    /* the second byte range rules out overlong forms, surrogates and code
+     * points past U+10FFFF */
+    int len;
+    uint32_t val;
+    uint8_t lo = 0x80;
+    uint8_t hi = 0xBF;
+    if (first >= 0xC2 && first <= 0xDF) {
+        len = 2;
+        val = first & 0x1F;
+    } else if (first >= 0xE0 && first <= 0xEF) {
+        len = 3;
+        val = first & 0x0F;
+        lo = first == 0xE0 ? 0xA0 : 0x80;
+        hi = first == 0xED ? 0x9F : 0xBF;
+    } else if (first >= 0xF0 && first <= 0xF4) {
+        len = 4;
+        val = first & 0x07;
+        lo = first == 0xF0 ? 0x90 : 0x80;
+        hi = first == 0xF4 ? 0x8F : 0xBF;
+    } else {
+        *cp = UTF8_REPLACEMENT;
+        return 1;
+    }
+
+    for (int i = 1; i < len; i++) {
+        if ((size_t)i >= size || p[i] < lo || p[i] > hi) {
+            *cp = UTF8_REPLACEMENT;
+            return i;
+        }
+        val = (val << 6) | (p[i] & 0x3F);
+        lo = 0x80;
+        hi = 0xBF;
+    }
+    *cp = val;
+    return len;
+}
+
+
+/* Decodes up to max code points from the first size bytes of s into cps,
+ * as utf8_decode_cp does, and returns how many were written. If used is not
+ * NULL it is set to the number of bytes consumed. s does not need to be NUL
+ * terminated, a NUL byte decodes as U+0000.
+ */
+size_t utf8_decode(const char *s, size_t size, uint32_t *cps, size_t max,
+        size_t *used)
+{
+    size_t count = 0;
+    size_t offset = 0;
+    while (offset < size && count < max) {
+        /* runs of ASCII are checked a word at a time */
+        while (size - offset >= sizeof(size_t) && max - count >=
+                sizeof(size_t) && utf8_ascii_word(&s[offset])) {
+            for (size_t i = 0; i < sizeof(size_t); i++) {
+                cps[count + i] = (uint8_t)s[offset + i];
+            }
+            offset += sizeof(size_t);
+            count += sizeof(size_t);
+        }
+        if (offset == size || count == max) {
+            break;
+        }
+        offset += utf8_decode_cp(&s[offset], size - offset, &cps[count++]);
+    }
+
+    if (used) {
+        *used = offset;
+    }
+    return count;
+}
+
+
+/* Number of code points utf8_decode would produce for the first size bytes
+ * of s.
+ */
+size_t utf8_count(const char *s, size_t size)
+{
+    size_t count = 0;
+    size_t offset = 0;
+    while (offset < size) {
+        if (size - offset >= sizeof(size_t) && utf8_ascii_word(&s[offset])) {
+            offset += sizeof(size_t);
+            count += sizeof(size_t);
+            continue;
+        }
+        uint32_t cp;
+        offset += utf8_decode_cp(&s[offset], size - offset, &cp);
+        count++;
+    }
+    return count;
+}
+
+
+/* Encodes cp into s, which must have room for 4 bytes, and returns the
+ * number of bytes written. s is not NUL terminated.
+ */
+int utf8_encode_cp(uint32_t cp, char *s)
+{
+    if (cp < 0x80) {
+        s[0] = cp;
+        return 1;
+    } else if (cp < 0x800) {
+        s[0] = 0xC0 | cp >> 6;
+        s[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    } else if (cp < 0x10000) {
+        s[0] = 0xE0 | cp >> 12;
+        s[1] = 0x80 | (cp >> 6 & 0x3F);
+        s[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+    s[0] = 0xF0 | cp >> 18;
+    s[1] = 0x80 | (cp >> 12 & 0x3F);
+    s[2] = 0x80 | (cp >> 6 & 0x3F);
+    s[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+
+
+/* True if the next sizeof(size_t) bytes of s are all ASCII. */
+static inline bool utf8_ascii_word(const char *s)
+{
+    size_t word;
+    memcpy(&word, s, sizeof(word));
+    return (word & UTF8_HIGH_BITS) == 0;
+}
@@ -3,6 +3,13 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#define UTF8_REPLACEMENT 0xFFFD
+
 
 int utf8_cp(const char * restrict s, uint32_t *ch);
 size_t utf8_len(const char *s);
+int utf8_decode_cp(const char *s, size_t size, uint32_t *cp);
+size_t utf8_decode(const char *s, size_t size, uint32_t *cps, size_t max,
+        size_t *used);
+size_t utf8_count(const char *s, size_t size);
+int utf8_encode_cp(uint32_t cp, char *s);
@@ -0,0 +1,163 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "worker_pool.h"
+
+
+/* A batch of jobs is published by bumping generation. Every thread then
+ * takes job indices until none are left and reports back through running,
+ * so the caller knows when the batch is done.
+ */
+struct worker_pool_t {
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned generation;
+    bool stop;
+    worker_pool_fn fn;
+    void *arg;
+    int jobs;
+    int next;
+    int running;
+    int thread_count;
+    pthread_t threads[];
+};
+
+static void *worker_pool_thread(void *arg);
+static void worker_pool_work(worker_pool_t *pool);
+
+
+/* Creates a pool that runs jobs on workers threads, one of which is the
+ * thread calling worker_pool_run. On ESP-IDF, esp_pthread_set_cfg before
+ * this call picks the core and stack size of the threads.
+ */
+worker_pool_t *worker_pool_new(int workers)
+{
+    int thread_count = workers > 1 ? workers - 1 : 0;
+    worker_pool_t *pool = calloc(1, sizeof(worker_pool_t) + thread_count *
+            sizeof(pthread_t));
+    assert(pool != NULL);
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (int i = 0; i < thread_count; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_pool_thread,
+                pool) != 0) {
+            break;
+        }
+        pool->thread_count++;
+    }
+    return pool;
+}
+
+
+void worker_pool_free(worker_pool_t *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+
+/* Number of threads jobs run on, including the caller.
+ */
+int worker_pool_size(const worker_pool_t *pool)
+{
+    return pool ? pool->thread_count + 1 : 1;
+}
+
+
+/* Calls fn(arg, job) for every job from 0 to jobs - 1, spread over the
+ * pool's threads, and returns when all have finished. A NULL pool runs
+ * the jobs on the calling thread.
+ */
+void worker_pool_run(worker_pool_t *pool, worker_pool_fn fn, void *arg,
+        int jobs)
+{
+    if (pool == NULL || pool->thread_count == 0 || jobs <= 1) {
+        for (int job = 0; job < jobs; job++) {
+            fn(arg, job);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->jobs = jobs;
+    pool->next = 0;
+    pool->running = pool->thread_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    worker_pool_work(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+static void *worker_pool_thread(void *arg)
+{
+    worker_pool_t *pool = arg;
+    unsigned generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->stop && pool->generation == generation) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->stop) {
+            break;
+        }
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        worker_pool_work(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+
+/* Takes jobs of the current batch until there are none left.
+ */
+static void worker_pool_work(worker_pool_t *pool)
+{
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        int job = pool->next < pool->jobs ? pool->next++ : -1;
+        worker_pool_fn fn = pool->fn;
+        void *arg = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+        if (job < 0) {
+            return;
+        }
+        fn(arg, job);
+    }
+}
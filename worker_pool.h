@@ -0,0 +1,13 @@
+#pragma once
+
+
+typedef struct worker_pool_t worker_pool_t;
+
+typedef void (*worker_pool_fn)(void *arg, int job);
+
+
+worker_pool_t *worker_pool_new(int workers);
+void worker_pool_free(worker_pool_t *pool);
+int worker_pool_size(const worker_pool_t *pool);
+void worker_pool_run(worker_pool_t *pool, worker_pool_fn fn, void *arg,
+        int jobs);